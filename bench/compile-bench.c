@@ -0,0 +1,707 @@
+/*
+ * Standalone benchmark of the copyjit code generation
+ *
+ * Synthetic expressions, shaped like the ones built by the executor for
+ * quals, projections and aggregate transitions, are compiled in a loop
+ * without any server. The time spent in each phase is reported per step:
+ *   - selection: choosing the stencils and computing the code size,
+ *   - emission: mapping the memory and copying the stencils,
+ *   - patching: filling the holes depending on the expression,
+ *   - mprotect: making the code executable,
+ *   - total: copyjit_compile_expr and the release of the context.
+ *
+ * The generated code is never run, so the PostgreSQL functions it calls are
+ * not needed: the executable is linked ignoring unresolved symbols, and the
+ * few backend functions used by the code generator are stubbed below.
+ *
+ * Usage: compile-bench [-n iterations] [-g max_ns_per_step] [-s max_steps]
+ * With -g, exits with an error if the total time per step of an expression is
+ * above the limit, so it can be used as a regression gate.
+ * With -s, expressions from 100 steps up to max_steps are compiled instead:
+ * chains of quals, of repeated immutable calls, and of CASE and OR arms all
+ * jumping to the same step. It exits with an error if, for one of them, the
+ * time per step of the largest one is more than SIZE_SWEEP_MAX_RATIO times the
+ * time per step of the smallest one: the compile time has to stay linear in the
+ * number of steps.
+ */
+#include "../src/copyjit.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+/*
+ * Stubs of the backend
+ */
+MemoryContext TopMemoryContext = NULL;
+MemoryContext CurrentMemoryContext = NULL;
+ResourceOwner CurrentResourceOwner = NULL;
+
+void *
+palloc(Size size)
+{
+	return malloc(size);
+}
+
+void *
+palloc0(Size size)
+{
+	return calloc(1, size);
+}
+
+void *
+repalloc(void *pointer, Size size)
+{
+	return realloc(pointer, size);
+}
+
+void
+pfree(void *pointer)
+{
+	free(pointer);
+}
+
+void *
+MemoryContextAlloc(MemoryContext context, Size size)
+{
+	return malloc(size);
+}
+
+void *
+MemoryContextAllocZero(MemoryContext context, Size size)
+{
+	return calloc(1, size);
+}
+
+#if PG_VERSION_NUM >= 170000
+void
+ResourceOwnerEnlarge(ResourceOwner owner)
+{
+}
+
+void
+ResourceOwnerRemember(ResourceOwner owner, Datum value, const ResourceOwnerDesc *kind)
+{
+}
+
+void
+ResourceOwnerForget(ResourceOwner owner, Datum value, const ResourceOwnerDesc *kind)
+{
+}
+#else
+void
+ResourceOwnerEnlargeJIT(ResourceOwner owner)
+{
+}
+
+void
+ResourceOwnerRememberJIT(ResourceOwner owner, Datum handle)
+{
+}
+#endif
+
+static int error_level;
+
+bool
+errstart(int elevel, const char *domain)
+{
+	error_level = elevel;
+	return elevel >= WARNING;
+}
+
+bool
+errstart_cold(int elevel, const char *domain)
+{
+	return errstart(elevel, domain);
+}
+
+int
+errmsg_internal(const char *fmt,...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+	return 0;
+}
+
+int
+errmsg(const char *fmt,...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+	return 0;
+}
+
+int
+errcode(int sqlerrcode)
+{
+	return 0;
+}
+
+int
+errhint(const char *fmt,...)
+{
+	return 0;
+}
+
+void
+errfinish(const char *filename, int lineno, const char *funcname)
+{
+	if (error_level >= ERROR) {
+		fprintf(stderr, "error raised at %s:%d\n", filename, lineno);
+		exit(2);
+	}
+}
+
+/* Catalog lookups of find_common_calls: every function is immutable and returns an int4 */
+char
+func_volatile(Oid funcid)
+{
+	return PROVOLATILE_IMMUTABLE;
+}
+
+Oid
+get_func_rettype(Oid funcid)
+{
+	return INT4OID;
+}
+
+int16
+get_typlen(Oid typid)
+{
+	return sizeof(int32);
+}
+
+/* Functions recognized by the code generator, they need their own address */
+Datum
+int4eq(PG_FUNCTION_ARGS)
+{
+	return (Datum) 0;
+}
+
+Datum
+int4lt(PG_FUNCTION_ARGS)
+{
+	return (Datum) 0;
+}
+
+static Datum
+bench_int4pl(PG_FUNCTION_ARGS)
+{
+	return (Datum) 0;
+}
+
+static Datum
+bench_int4gt(PG_FUNCTION_ARGS)
+{
+	return (Datum) 0;
+}
+
+/*
+ * Synthetic expressions
+ */
+typedef struct BenchExpr
+{
+	const char *name;
+	ExprState *(*build) (void);
+} BenchExpr;
+
+static EState bench_estate;
+static PlanState bench_planstate;
+
+static ExprState *
+new_expression(int steps_len, int result_columns)
+{
+	ExprState *state = calloc(1, sizeof(ExprState));
+
+	state->steps = calloc(steps_len, sizeof(ExprEvalStep));
+	state->steps_len = steps_len;
+	state->parent = &bench_planstate;
+	if (result_columns > 0) {
+		state->resultslot = calloc(1, sizeof(TupleTableSlot));
+		state->resultslot->tts_values = calloc(result_columns, sizeof(Datum));
+		state->resultslot->tts_isnull = calloc(result_columns, sizeof(bool));
+	}
+	for (int opno = 0 ; opno < steps_len ; opno++) {
+		state->steps[opno].resvalue = &state->resvalue;
+		state->steps[opno].resnull = &state->resnull;
+	}
+	return state;
+}
+
+static void
+set_fetch(ExprState *state, int opno, ExprEvalOp opcode, int last_var)
+{
+	state->steps[opno].opcode = opcode;
+	state->steps[opno].d.fetch.last_var = last_var;
+}
+
+/* A strict function with two arguments, filled by the two previous steps */
+static void
+set_function(ExprState *state, int opno, PGFunction fn_addr)
+{
+	ExprEvalStep *op = &state->steps[opno];
+	FunctionCallInfo fcinfo = calloc(1, SizeForFunctionCallInfo(2));
+
+	op->opcode = EEOP_FUNCEXPR_STRICT;
+	op->d.func.fcinfo_data = fcinfo;
+	op->d.func.fn_addr = fn_addr;
+	op->d.func.nargs = 2;
+	state->steps[opno - 2].resvalue = &fcinfo->args[0].value;
+	state->steps[opno - 2].resnull = &fcinfo->args[0].isnull;
+	state->steps[opno - 1].resvalue = &fcinfo->args[1].value;
+	state->steps[opno - 1].resnull = &fcinfo->args[1].isnull;
+}
+
+static void
+set_var(ExprState *state, int opno, ExprEvalOp opcode, int attnum)
+{
+	state->steps[opno].opcode = opcode;
+	state->steps[opno].d.var.attnum = attnum;
+}
+
+static void
+set_const(ExprState *state, int opno, Datum value)
+{
+	state->steps[opno].opcode = EEOP_CONST;
+	state->steps[opno].d.constval.value = value;
+	state->steps[opno].d.constval.isnull = false;
+}
+
+/* WHERE a = 1 AND b < 10 AND c IS NOT NULL */
+static ExprState *
+build_qual(void)
+{
+	ExprState *state = new_expression(13, 0);
+
+	set_fetch(state, 0, EEOP_SCAN_FETCHSOME, 3);
+	set_var(state, 1, EEOP_SCAN_VAR, 0);
+	set_const(state, 2, Int32GetDatum(1));
+	set_function(state, 3, int4eq);
+	state->steps[4].opcode = EEOP_QUAL;
+	state->steps[4].d.qualexpr.jumpdone = 12;
+	set_var(state, 5, EEOP_SCAN_VAR, 1);
+	set_const(state, 6, Int32GetDatum(10));
+	set_function(state, 7, int4lt);
+	state->steps[8].opcode = EEOP_QUAL;
+	state->steps[8].d.qualexpr.jumpdone = 12;
+	set_var(state, 9, EEOP_SCAN_VAR, 2);
+	state->steps[10].opcode = EEOP_NULLTEST_ISNOTNULL;
+	state->steps[11].opcode = EEOP_QUAL;
+	state->steps[11].d.qualexpr.jumpdone = 12;
+	state->steps[12].opcode = EEOP_DONE_RETURN;
+	return state;
+}
+
+/* WHERE a + b > c, calling the functions through fmgr */
+static ExprState *
+build_generic_qual(void)
+{
+	ExprState *state = new_expression(9, 0);
+
+	set_fetch(state, 0, EEOP_SCAN_FETCHSOME, 3);
+	set_var(state, 1, EEOP_SCAN_VAR, 0);
+	set_var(state, 2, EEOP_SCAN_VAR, 1);
+	set_function(state, 3, bench_int4pl);
+	set_var(state, 4, EEOP_SCAN_VAR, 2);
+	set_function(state, 5, bench_int4gt);
+	// The sum is the first argument of the comparison
+	state->steps[3].resvalue = &state->steps[5].d.func.fcinfo_data->args[0].value;
+	state->steps[3].resnull = &state->steps[5].d.func.fcinfo_data->args[0].isnull;
+	state->steps[4].resvalue = &state->steps[5].d.func.fcinfo_data->args[1].value;
+	state->steps[4].resnull = &state->steps[5].d.func.fcinfo_data->args[1].isnull;
+	state->steps[6].opcode = EEOP_QUAL;
+	state->steps[6].d.qualexpr.jumpdone = 8;
+	state->steps[7].opcode = EEOP_CONST;
+	state->steps[8].opcode = EEOP_DONE_RETURN;
+	return state;
+}
+
+/* SELECT a, b, ..., j: a run of column assignments */
+static ExprState *
+build_projection(void)
+{
+	ExprState *state = new_expression(12, 10);
+
+	set_fetch(state, 0, EEOP_SCAN_FETCHSOME, 10);
+	for (int column = 0 ; column < 10 ; column++) {
+		state->steps[column + 1].opcode = EEOP_ASSIGN_SCAN_VAR;
+		state->steps[column + 1].d.assign_var.attnum = column;
+		state->steps[column + 1].d.assign_var.resultnum = column;
+	}
+	state->steps[11].opcode = EEOP_DONE_RETURN;
+	return state;
+}
+
+/* SELECT j, c, a, a + b: shuffled columns and a computed one */
+static ExprState *
+build_mixed_projection(void)
+{
+	ExprState *state = new_expression(9, 4);
+
+	set_fetch(state, 0, EEOP_SCAN_FETCHSOME, 10);
+	state->steps[1].opcode = EEOP_ASSIGN_SCAN_VAR;
+	state->steps[1].d.assign_var.attnum = 9;
+	state->steps[1].d.assign_var.resultnum = 0;
+	state->steps[2].opcode = EEOP_ASSIGN_SCAN_VAR;
+	state->steps[2].d.assign_var.attnum = 2;
+	state->steps[2].d.assign_var.resultnum = 1;
+	state->steps[3].opcode = EEOP_ASSIGN_SCAN_VAR;
+	state->steps[3].d.assign_var.attnum = 0;
+	state->steps[3].d.assign_var.resultnum = 2;
+	set_var(state, 4, EEOP_SCAN_VAR, 0);
+	set_var(state, 5, EEOP_SCAN_VAR, 1);
+	set_function(state, 6, bench_int4pl);
+	state->steps[7].opcode = EEOP_ASSIGN_TMP;
+	state->steps[7].d.assign_tmp.resultnum = 3;
+	state->steps[8].opcode = EEOP_DONE_RETURN;
+	return state;
+}
+
+/* sum(a), count(b): strict by-value transitions */
+static ExprState *
+build_aggregate(void)
+{
+	ExprState *state = new_expression(10, 0);
+
+	set_fetch(state, 0, EEOP_OUTER_FETCHSOME, 2);
+	for (int transno = 0 ; transno < 2 ; transno++) {
+		int first = 1 + transno * 4;
+		int next = first + 4;
+
+		set_var(state, first, EEOP_OUTER_VAR, transno);
+		state->steps[first + 1].opcode = EEOP_AGG_STRICT_INPUT_CHECK_ARGS;
+		state->steps[first + 1].d.agg_strict_input_check.jumpnull = next;
+		state->steps[first + 2].opcode = EEOP_AGG_PLAIN_PERGROUP_NULLCHECK;
+		state->steps[first + 2].d.agg_plain_pergroup_nullcheck.jumpnull = next;
+		state->steps[first + 3].opcode = EEOP_AGG_PLAIN_TRANS_STRICT_BYVAL;
+		state->steps[first + 3].d.agg_trans.transno = transno;
+	}
+	state->steps[9].opcode = EEOP_DONE_RETURN;
+	return state;
+}
+
+/*
+ * WHERE a0 < a1 AND a1 < a2 AND ...: as many quals as fit in steps_len, all
+ * jumping to the end
+ */
+static ExprState *
+build_qual_chain(int steps_len)
+{
+	int quals = (steps_len - 2) / 4;
+	ExprState *state = new_expression(quals * 4 + 2, 0);
+	int done = quals * 4 + 1;
+
+	set_fetch(state, 0, EEOP_SCAN_FETCHSOME, quals + 1);
+	for (int qual = 0 ; qual < quals ; qual++) {
+		int first = 1 + qual * 4;
+
+		// Distinct columns, no call can reuse the result of another one
+		set_var(state, first, EEOP_SCAN_VAR, qual);
+		set_var(state, first + 1, EEOP_SCAN_VAR, qual + 1);
+		set_function(state, first + 2, int4lt);
+		state->steps[first + 3].opcode = EEOP_QUAL;
+		state->steps[first + 3].d.qualexpr.jumpdone = done;
+	}
+	state->steps[done].opcode = EEOP_DONE_RETURN;
+	return state;
+}
+
+/*
+ * SELECT a0 + a1, a0 + a1, a1 + a2, a1 + a2, ...: every call repeated, the
+ * second one reusing the result of the first
+ */
+static ExprState *
+build_repeated_calls(int steps_len)
+{
+	static FmgrInfo finfo = {.fn_addr = bench_int4pl, .fn_oid = 1};
+	int pairs = (steps_len - 2) / 8;
+	ExprState *state = new_expression(pairs * 8 + 2, pairs * 2);
+
+	set_fetch(state, 0, EEOP_SCAN_FETCHSOME, pairs + 1);
+	for (int call = 0 ; call < pairs * 2 ; call++) {
+		int first = 1 + call * 4;
+
+		set_var(state, first, EEOP_SCAN_VAR, call / 2);
+		set_var(state, first + 1, EEOP_SCAN_VAR, call / 2 + 1);
+		set_function(state, first + 2, bench_int4pl);
+		state->steps[first + 2].d.func.finfo = &finfo;
+		state->steps[first + 3].opcode = EEOP_ASSIGN_TMP;
+		state->steps[first + 3].d.assign_tmp.resultnum = call;
+	}
+	state->steps[pairs * 8 + 1].opcode = EEOP_DONE_RETURN;
+	return state;
+}
+
+/*
+ * CASE WHEN a0 < a1 THEN 0 WHEN a1 < a2 THEN 1 ... END: every arm jumps to the
+ * end, the conditions to the next arm
+ */
+static ExprState *
+build_case_fan_in(int steps_len)
+{
+	int arms = (steps_len - 3) / 6;
+	ExprState *state = new_expression(arms * 6 + 3, 0);
+	int done = arms * 6 + 2;
+
+	set_fetch(state, 0, EEOP_SCAN_FETCHSOME, arms + 1);
+	for (int arm = 0 ; arm < arms ; arm++) {
+		int first = 1 + arm * 6;
+
+		set_var(state, first, EEOP_SCAN_VAR, arm);
+		set_var(state, first + 1, EEOP_SCAN_VAR, arm + 1);
+		set_function(state, first + 2, int4lt);
+		state->steps[first + 3].opcode = EEOP_JUMP_IF_NOT_TRUE;
+		state->steps[first + 3].d.jump.jumpdone = first + 6;
+		set_const(state, first + 4, Int32GetDatum(arm));
+		state->steps[first + 5].opcode = EEOP_JUMP;
+		state->steps[first + 5].d.jump.jumpdone = done;
+	}
+	// ELSE NULL
+	set_const(state, done - 1, (Datum) 0);
+	state->steps[done - 1].d.constval.isnull = true;
+	state->steps[done].opcode = EEOP_DONE_RETURN;
+	return state;
+}
+
+/* WHERE a0 < a1 OR a1 < a2 OR ...: every arm jumps to the end when true */
+static ExprState *
+build_or_fan_in(int steps_len)
+{
+	int arms = (steps_len - 2) / 4;
+	ExprState *state = new_expression(arms * 4 + 2, 0);
+	int done = arms * 4 + 1;
+	bool *anynull = calloc(1, sizeof(bool));
+
+	set_fetch(state, 0, EEOP_SCAN_FETCHSOME, arms + 1);
+	for (int arm = 0 ; arm < arms ; arm++) {
+		int first = 1 + arm * 4;
+
+		set_var(state, first, EEOP_SCAN_VAR, arm);
+		set_var(state, first + 1, EEOP_SCAN_VAR, arm + 1);
+		set_function(state, first + 2, int4lt);
+		state->steps[first + 3].opcode = arm == 0 ? EEOP_BOOL_OR_STEP_FIRST :
+			(arm == arms - 1 ? EEOP_BOOL_OR_STEP_LAST : EEOP_BOOL_OR_STEP);
+		state->steps[first + 3].d.boolexpr.anynull = anynull;
+		state->steps[first + 3].d.boolexpr.jumpdone = done;
+	}
+	state->steps[done].opcode = EEOP_DONE_RETURN;
+	return state;
+}
+
+static const BenchExpr expressions[] = {
+	{"qual", build_qual},
+	{"generic_qual", build_generic_qual},
+	{"projection", build_projection},
+	{"mixed_projection", build_mixed_projection},
+	{"aggregate", build_aggregate},
+};
+
+static uint64
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Run the phases of copyjit_compile_expr one by one, then the whole function.
+ * Returns the total time per step, in nanoseconds.
+ */
+static double
+bench_expression(const BenchExpr *expr, int iterations)
+{
+	ExprState *state = expr->build();
+	uint64 selection = 0, emission = 0, patching = 0, protection = 0, total = 0;
+	size_t code_bytes = 0;
+	double steps = (double) state->steps_len * iterations;
+
+	for (int i = 0 ; i < iterations ; i++) {
+		CodeGen codeGen;
+		uint64 t0, t1, t2, t3, t4;
+		size_t total_size;
+
+		memset(&codeGen, 0, sizeof(codeGen));
+		codeGen.unsupported_opcode = -1;
+		t0 = now_ns();
+		arena_reserve((void **) &arena.offsets, &arena.offsets_capacity, state->steps_len + 1, sizeof(int));
+		codeGen.offsets = arena.offsets;
+		if (!emit_steps(state, &codeGen)) {
+			fprintf(stderr, "%s: unsupported opcode %s\n", expr->name, opcodeNames[codeGen.unsupported_opcode]);
+			return 0;
+		}
+		codeGen.offsets[state->steps_len] = codeGen.code_size;
+		t1 = now_ns();
+		total_size = codeGen.code_size + codeGen.required_trampolines * TRAMPOLINE_SIZE;
+		codeGen.code.as_void = mmap(0, total_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (TRAMPOLINE_SIZE && codeGen.required_trampolines > 0)
+			reserve_trampolines(&codeGen);
+		copy_records(&codeGen);
+		t2 = now_ns();
+		patch_records(state, &codeGen);
+		t3 = now_ns();
+		mprotect(codeGen.code.as_void, total_size, PROT_READ|PROT_EXEC);
+		t4 = now_ns();
+		munmap(codeGen.code.as_void, total_size);
+		free(codeGen.trampolines);
+
+		selection += t1 - t0;
+		emission += t2 - t1;
+		patching += t3 - t2;
+		protection += t4 - t3;
+		code_bytes = total_size;
+	}
+
+	for (int i = 0 ; i < iterations ; i++) {
+		uint64 start = now_ns();
+
+		bench_estate.es_jit = NULL;
+		if (!copyjit_compile_expr(state)) {
+			fprintf(stderr, "%s: not compiled\n", expr->name);
+			return 0;
+		}
+		copyjit_release_context(bench_estate.es_jit);
+		total += now_ns() - start;
+		free(bench_estate.es_jit);
+		free(state->evalfunc_private);
+	}
+
+	printf("%-18s %5d %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		   expr->name, state->steps_len, code_bytes,
+		   selection / steps, emission / steps, patching / steps, protection / steps, total / steps);
+	return total / steps;
+}
+
+/* Expressions of the size sweep, built with about steps_len steps */
+typedef struct SizedExpr
+{
+	const char *name;
+	ExprState *(*build) (int steps_len);
+} SizedExpr;
+
+static const SizedExpr sized_expressions[] = {
+	{"qual_chain", build_qual_chain},
+	{"repeated_calls", build_repeated_calls},
+	{"case_fan_in", build_case_fan_in},
+	{"or_fan_in", build_or_fan_in},
+};
+
+/* Slowdown per step tolerated between the smallest and the largest expression */
+#define SIZE_SWEEP_MAX_RATIO 4.0
+
+/*
+ * Compile the expression at growing sizes, each about as many times as needed
+ * to compile a few million steps. Returns false if the time per step grows
+ * with the size.
+ */
+static bool
+bench_size_sweep(const SizedExpr *expr, int max_steps)
+{
+	double smallest = 0, ns_per_step = 0;
+	int steps_len = 0;
+
+	for (int size = 100 ; size <= max_steps ; size *= 10) {
+		ExprState *state = expr->build(size);
+		int iterations = Max(2, 2000000 / size);
+		uint64 total = 0;
+		int64 code_bytes = 0;
+
+		for (int i = 0 ; i < iterations ; i++) {
+			uint64 start = now_ns();
+
+			bench_estate.es_jit = NULL;
+			if (!copyjit_compile_expr(state) || ((CopyJitContext *) bench_estate.es_jit)->counters.fallbacks > 0) {
+				fprintf(stderr, "%s: %d steps not compiled\n", expr->name, state->steps_len);
+				return false;
+			}
+			code_bytes = ((CopyJitContext *) bench_estate.es_jit)->counters.code_bytes;
+			copyjit_release_context(bench_estate.es_jit);
+			total += now_ns() - start;
+			free(bench_estate.es_jit);
+			free(state->evalfunc_private);
+		}
+		steps_len = state->steps_len;
+		ns_per_step = (double) total / ((double) steps_len * iterations);
+		if (smallest == 0)
+			smallest = ns_per_step;
+		printf("%-18s %8d %10lld %10.1f\n", expr->name, steps_len, (long long) code_bytes, ns_per_step);
+	}
+	if (ns_per_step > smallest * SIZE_SWEEP_MAX_RATIO) {
+		fprintf(stderr, "%s: %.1f ns per step with %d steps, more than %.0f times the %.1f of the smallest one\n",
+				expr->name, ns_per_step, steps_len, SIZE_SWEEP_MAX_RATIO, smallest);
+		return false;
+	}
+	return true;
+}
+
+static bool
+bench_sizes(int max_steps)
+{
+	bool linear = true;
+
+	printf("%-18s %8s %10s %10s\n", "expression", "steps", "bytes", "ns/step");
+	for (int e = 0 ; e < lengthof(sized_expressions) ; e++) {
+		if (!bench_size_sweep(&sized_expressions[e], max_steps))
+			linear = false;
+	}
+	return linear;
+}
+
+int
+main(int argc, char **argv)
+{
+	int iterations = 10000;
+	double gate = 0;
+	int max_steps = 0;
+	int option;
+	bool failed = false;
+
+	while ((option = getopt(argc, argv, "n:g:s:")) != -1) {
+		switch (option) {
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			case 'g':
+				gate = atof(optarg);
+				break;
+			case 's':
+				max_steps = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n iterations] [-g max_ns_per_step] [-s max_steps]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	bench_planstate.state = &bench_estate;
+	bench_estate.es_jit_flags = PGJIT_PERFORM | PGJIT_EXPR;
+	// Parallel templates and statistics need the shared memory, they are left out
+	copyjit_min_steps = 0;
+	prepare_stencil_programs();
+	if (max_steps > 0)
+		return bench_sizes(max_steps) ? 0 : 1;
+
+	printf("%-18s %5s %8s %10s %10s %10s %10s %10s\n",
+		   "expression", "steps", "bytes", "selection", "emission", "patching", "mprotect", "total");
+	printf("%-18s %5s %8s %10s %10s %10s %10s %10s\n",
+		   "", "", "", "ns/step", "ns/step", "ns/step", "ns/step", "ns/step");
+	for (int e = 0 ; e < lengthof(expressions) ; e++) {
+		double ns_per_step = bench_expression(&expressions[e], iterations);
+
+		if (ns_per_step == 0 || (gate > 0 && ns_per_step > gate)) {
+			if (ns_per_step > 0)
+				fprintf(stderr, "%s: %.1f ns per step, above the %.1f limit\n", expressions[e].name, ns_per_step, gate);
+			failed = true;
+		}
+	}
+	return failed ? 1 : 0;
+}
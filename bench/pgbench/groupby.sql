@@ -0,0 +1,4 @@
+-- GROUP BY aggregates over a range of rows
+\set aid random(1, :rows - 20000)
+SELECT bid, count(*), sum(abalance), min(abalance), max(abalance), count(category)
+	FROM bench_accounts WHERE aid BETWEEN :aid AND :aid + 20000 GROUP BY bid;
@@ -0,0 +1,3 @@
+-- Short OLTP lookup by primary key
+\set aid random(1, :rows)
+SELECT aid, abalance, category FROM bench_accounts WHERE aid = :aid;
@@ -0,0 +1,4 @@
+-- Wide projection of a range of rows
+\set id random(1, :rows - 1000)
+SELECT id, c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11 + c12, c13, c14, c15, c16
+	FROM bench_wide WHERE id BETWEEN :id AND :id + 1000;
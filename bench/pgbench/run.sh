@@ -0,0 +1,130 @@
+#!/bin/bash
+#
+# End-to-end benchmark of copyjit against the interpreter and llvmjit.
+#
+# A throwaway cluster is created in a temporary directory, loaded with the
+# datasets of setup.sql, then every pgbench script runs under each JIT
+# configuration, with jit_above_cost=0 so that every query is compiled.
+# copyjit must be installed (make install) in the server used.
+#
+# Settings, from the environment:
+#   PG_CONFIG  pg_config of the server to use (default: the one in PATH)
+#   DURATION   seconds per run (default 30)
+#   CLIENTS    pgbench clients (default 1)
+#   ROWS       rows of the datasets (default 200000)
+#   PORT       port of the throwaway cluster (default 54329)
+#   RESULTS    CSV file receiving the results (default bench/pgbench/results.csv)
+
+set -e
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+DURATION=${DURATION:-30}
+CLIENTS=${CLIENTS:-1}
+ROWS=${ROWS:-200000}
+PORT=${PORT:-54329}
+HERE=$(cd "$(dirname "$0")" && pwd)
+RESULTS=${RESULTS:-$HERE/results.csv}
+
+BINDIR=$($PG_CONFIG --bindir)
+PKGLIBDIR=$($PG_CONFIG --pkglibdir)
+WORKDIR=$(mktemp -d -t copyjit-bench.XXXXXX)
+PGDATA=$WORKDIR/data
+export PGHOST=$WORKDIR PGPORT=$PORT PGDATABASE=postgres
+
+stop_cluster() {
+	if [ -f "$PGDATA/postmaster.pid" ]; then
+		"$BINDIR/pg_ctl" -D "$PGDATA" -m fast -w stop > /dev/null
+	fi
+}
+
+cleanup() {
+	stop_cluster
+	rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+# Start the cluster with the given JIT provider, the provider can not change without a restart
+start_cluster() {
+	local preload=pg_stat_statements
+
+	if [ "$1" = copyjit ]; then
+		preload=$preload,copyjit
+	fi
+	"$BINDIR/pg_ctl" -D "$PGDATA" -l "$WORKDIR/server.log" -w start \
+		-o "-p $PORT -k $WORKDIR -c listen_addresses='' -c jit_provider=$1 -c shared_preload_libraries=$preload" > /dev/null
+}
+
+psql_value() {
+	"$BINDIR/psql" -X -A -t -q -v ON_ERROR_STOP=1 -c "$1"
+}
+
+# Total JIT time of the statements run since the last reset, in ms. The JIT
+# columns of pg_stat_statements only exist since PostgreSQL 15.
+jit_time() {
+	if [ "$(psql_value "SHOW server_version_num")" -ge 150000 ]; then
+		psql_value "SELECT round(coalesce(sum(jit_generation_time + jit_inlining_time + jit_optimization_time + jit_emission_time), 0)::numeric, 1)
+					FROM pg_stat_statements WHERE query NOT LIKE '%pg_stat_statements%'"
+	else
+		echo "n/a"
+	fi
+}
+
+# Latency percentile, in ms, from the transaction logs of pgbench
+percentile() {
+	cat "$WORKDIR"/log/pgbench_log.* | awk '{ print $3 }' | sort -n |
+		awk -v p="$1" '{ latency[NR] = $1 } END { i = int(NR * p / 100); if (i < 1) i = 1; printf "%.3f", latency[i] / 1000 }'
+}
+
+# run_script <configuration> <script> <query mode> [generic]
+run_script() {
+	local config=$1 script=$2 mode=$3 variant=$2-$3 options="-c jit_above_cost=0"
+	local tps
+
+	case $config in
+		interpreter) options="-c jit=off" ;;
+		*) options="$options -c jit=on" ;;
+	esac
+	if [ "$4" = generic ]; then
+		options="$options -c plan_cache_mode=force_generic_plan"
+		variant=$2-generic
+	fi
+
+	rm -rf "$WORKDIR/log"
+	mkdir "$WORKDIR/log"
+	psql_value "SELECT pg_stat_statements_reset()" > /dev/null
+	tps=$(cd "$WORKDIR/log" && PGOPTIONS="$options" "$BINDIR/pgbench" -n -T "$DURATION" -c "$CLIENTS" -j "$CLIENTS" \
+		-M "$mode" -D rows="$ROWS" -f "$HERE/$script.sql" -l 2>&1 |
+		sed -n 's/^tps = \([0-9.]*\).*/\1/p' | tail -1)
+
+	printf "%-12s %-18s %10s %9s %9s %9s %12s\n" "$config" "$variant" "$tps" \
+		"$(percentile 50)" "$(percentile 95)" "$(percentile 99)" "$(jit_time)"
+	echo "$config,$variant,$tps,$(percentile 50),$(percentile 95),$(percentile 99),$(jit_time)" >> "$RESULTS"
+}
+
+configurations="interpreter copyjit"
+if [ -f "$PKGLIBDIR/llvmjit.so" ]; then
+	configurations="interpreter llvmjit copyjit"
+else
+	echo "llvmjit is not installed, skipping it"
+fi
+
+"$BINDIR/initdb" -D "$PGDATA" -A trust --no-sync > "$WORKDIR/initdb.log"
+start_cluster llvmjit
+"$BINDIR/psql" -X -q -v ON_ERROR_STOP=1 -v rows="$ROWS" -f "$HERE/setup.sql" > /dev/null
+psql_value "CREATE EXTENSION pg_stat_statements" > /dev/null
+stop_cluster
+
+echo "configuration,script,tps,p50_ms,p95_ms,p99_ms,jit_ms" > "$RESULTS"
+printf "%-12s %-18s %10s %9s %9s %9s %12s\n" configuration script tps "p50 ms" "p95 ms" "p99 ms" "jit ms"
+for config in $configurations; do
+	start_cluster "$([ $config = copyjit ] && echo copyjit || echo llvmjit)"
+	for script in lookup scan projection groupby; do
+		run_script $config $script simple
+	done
+	for script in lookup scan groupby; do
+		run_script $config $script prepared
+		run_script $config $script prepared generic
+	done
+	stop_cluster
+done
+echo "Results written to $RESULTS"
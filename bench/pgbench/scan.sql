@@ -0,0 +1,4 @@
+-- Filtered scan of a bucket, several quals per row
+\set bid random(0, 99)
+SELECT count(*) FROM bench_accounts
+	WHERE bid = :bid AND abalance < 25000 AND abalance > -25000 AND category IS NOT NULL;
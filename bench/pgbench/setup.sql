@@ -0,0 +1,27 @@
+-- Datasets of the pgbench suite, generated the same way on every run
+SELECT setseed(0.42);
+
+CREATE TABLE bench_accounts (
+	aid integer PRIMARY KEY,
+	bid integer NOT NULL,
+	abalance integer NOT NULL,
+	category text,
+	created date NOT NULL
+);
+INSERT INTO bench_accounts
+	SELECT aid, aid % 100, (random() * 100000)::integer - 50000,
+		   CASE WHEN aid % 7 = 0 THEN NULL ELSE 'category ' || (aid % 13) END,
+		   date '2020-01-01' + (aid % 1000)
+	FROM generate_series(1, :rows) AS aid;
+CREATE INDEX ON bench_accounts (bid);
+
+CREATE TABLE bench_wide AS
+	SELECT id, id % 10 AS c1, id % 11 AS c2, id % 12 AS c3, id % 13 AS c4, id % 14 AS c5,
+		   id % 15 AS c6, id % 16 AS c7, id % 17 AS c8, id % 18 AS c9, id % 19 AS c10,
+		   (random() * 1000)::integer AS c11, (random() * 1000)::integer AS c12,
+		   (random() * 1000)::numeric(10, 2) AS c13, md5(id::text) AS c14,
+		   CASE WHEN id % 5 = 0 THEN NULL ELSE id END AS c15, id * 2 AS c16
+	FROM generate_series(1, :rows) AS id;
+ALTER TABLE bench_wide ADD PRIMARY KEY (id);
+
+VACUUM ANALYZE bench_accounts, bench_wide;
@@ -0,0 +1,7 @@
+-- Not TPC-H: single subscripts of small integer arrays, out of bounds ones included
+SELECT p_tags[1] AS tag, count(*) AS parts, sum(p_tags[2] + p_tags[3]) AS tag_sum, sum(p_stock[1] % 1000 + p_stock[2]) AS stock,
+	   count(p_tags[0]) AS below, count(p_tags[4]) AS above, count(p_tags[-2147483647 - 1]) AS lowest
+FROM part
+WHERE p_tags[1] < 8 AND p_stock[1] > 0
+GROUP BY p_tags[1]
+ORDER BY p_tags[1];
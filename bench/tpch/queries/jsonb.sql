@@ -0,0 +1,7 @@
+-- Not TPC-H: jsonb fields read with constant keys
+SELECT p_attrs->>'color' AS color, count(*) AS parts, sum((p_attrs->>'weight')::integer) AS weight,
+	   count(p_attrs->'missing') AS missing, count(*) FILTER (WHERE p_attrs->'promo' = 'true') AS promo
+FROM part
+WHERE p_attrs->>'color' <> 'khaki'
+GROUP BY p_attrs->>'color'
+ORDER BY p_attrs->>'color';
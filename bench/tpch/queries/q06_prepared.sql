@@ -0,0 +1,7 @@
+-- Forecasting revenue change, with parameters: PARAM_EXTERN steps with a generic plan
+PREPARE revenue(date, numeric, numeric) AS
+SELECT sum(l_extendedprice * l_discount) AS revenue
+FROM lineitem
+WHERE l_shipdate >= $1 AND l_shipdate < $1 + interval '1 year'
+  AND l_discount BETWEEN $2 - 0.01 AND $2 + 0.01 AND l_quantity < $3;
+EXECUTE revenue('1994-01-01', 0.06, 24);
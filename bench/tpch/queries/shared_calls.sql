@@ -0,0 +1,5 @@
+-- Not TPC-H: the same immutable call twice, one result modified in place by array_append
+SELECT array_append(array_append(a, 1), 2) AS appended_twice, array_append(a, 1) AS appended_once
+FROM (SELECT array[l_orderkey] AS a FROM lineitem OFFSET 0) s
+ORDER BY appended_twice
+LIMIT 100;
@@ -0,0 +1,7 @@
+-- Not TPC-H: SQL value functions, the date and time ones cached for the statement
+SELECT o_orderpriority, count(*) FILTER (WHERE o_orderdate < CURRENT_DATE) AS past,
+	   count(*) FILTER (WHERE CURRENT_TIMESTAMP > o_orderdate AND LOCALTIMESTAMP > o_orderdate) AS before_now,
+	   count(*) FILTER (WHERE current_user = session_user AND current_schema IS NOT NULL) AS same_user
+FROM orders
+GROUP BY o_orderpriority
+ORDER BY o_orderpriority;
@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+"""
+Differential benchmark of copyjit on TPC-H like analytical queries.
+
+A throwaway cluster is created with copyjit as JIT provider and loaded with
+the data of setup.sql. Every query of the queries directory then runs with the
+interpreter (jit=off) and with copyjit (jit_above_cost=0):
+  - the result sets of both must be identical, and so must the ones of copyjit
+    with the optional features turned on (VARIANTS),
+  - the median execution and JIT times are compared,
+  - the opcodes that made copyjit fall back to the interpreter are listed.
+A forced parallel scan then checks the workers reuse the code of their leader.
+
+The results are written as JSON. The run fails when a result differs, or when
+copyjit is more than --max-regression percent slower than the interpreter, or
+than the copyjit time of the --baseline file when one is given, or when the
+parallel workers found no template.
+copyjit must be installed (make install) in the server used.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+INTERPRETER = "-c jit=off"
+COPYJIT = "-c jit=on -c jit_above_cost=0"
+# Features off by default, each compared with the interpreter too. The generic plans
+# only matter for the queries with a PREPARE, their parameters become PARAM_EXTERN steps.
+VARIANTS = {
+    "memoize": COPYJIT + " -c copyjit.memoize_min_cost=1",
+    "pgo": COPYJIT + " -c copyjit.pgo_evaluations=100",
+    "tier_up": COPYJIT + " -c copyjit.tier_up_threshold=1000",
+    "generic_plan": COPYJIT + " -c plan_cache_mode=force_generic_plan",
+}
+PARALLEL = COPYJIT + (" -c parallel_setup_cost=0 -c parallel_tuple_cost=0 -c min_parallel_table_scan_size=0"
+                      " -c max_parallel_workers_per_gather=2")
+
+
+class Cluster:
+    def __init__(self, pg_config, port):
+        self.bindir = subprocess.check_output([pg_config, "--bindir"], text=True).strip()
+        self.workdir = tempfile.mkdtemp(prefix="copyjit-tpch.")
+        self.pgdata = os.path.join(self.workdir, "data")
+        self.port = port
+        self.env = dict(os.environ, PGHOST=self.workdir, PGPORT=str(port), PGDATABASE="postgres")
+
+    def start(self):
+        with open(os.path.join(self.workdir, "initdb.log"), "w") as log:
+            subprocess.check_call([os.path.join(self.bindir, "initdb"), "-D", self.pgdata, "-A", "trust", "--no-sync"],
+                                  stdout=log)
+        subprocess.check_call([os.path.join(self.bindir, "pg_ctl"), "-D", self.pgdata, "-w", "start",
+                               "-l", os.path.join(self.workdir, "server.log"),
+                               "-o", "-p %d -k %s -c listen_addresses='' -c jit_provider=copyjit "
+                                     "-c shared_preload_libraries=copyjit" % (self.port, self.workdir)],
+                              stdout=subprocess.DEVNULL)
+
+    def stop(self):
+        if os.path.exists(os.path.join(self.pgdata, "postmaster.pid")):
+            subprocess.call([os.path.join(self.bindir, "pg_ctl"), "-D", self.pgdata, "-m", "fast", "-w", "stop"],
+                            stdout=subprocess.DEVNULL)
+        shutil.rmtree(self.workdir, ignore_errors=True)
+
+    def psql(self, sql=None, options="", filename=None, variables=None):
+        command = [os.path.join(self.bindir, "psql"), "-X", "-A", "-t", "-q", "-v", "ON_ERROR_STOP=1"]
+        for name, value in (variables or {}).items():
+            command += ["-v", "%s=%s" % (name, value)]
+        command += ["-f", filename] if filename else ["-c", sql]
+        return subprocess.check_output(command, env=dict(self.env, PGOPTIONS=options), text=True)
+
+
+def split_prelude(query):
+    """The statements of the query before the last one, like a PREPARE, and the last one."""
+    prelude, _, last = query.strip().rstrip(";").rpartition(";")
+    return (prelude + ";\n" if prelude else ""), last
+
+
+def measure(cluster, query, options, repeat):
+    """Median execution and JIT times of the query, in ms."""
+    executions = []
+    jit = []
+    prelude, last = split_prelude(query)
+    for _ in range(repeat):
+        # Sent as a single string, psql only prints the result of the last statement
+        plan = json.loads(cluster.psql(prelude + "EXPLAIN (ANALYZE, TIMING OFF, FORMAT JSON) " + last, options))[0]
+        executions.append(plan["Execution Time"])
+        jit.append(plan.get("JIT", {}).get("Timing", {}).get("Total", 0.0))
+    return statistics.median(executions), statistics.median(jit)
+
+
+def run_query(cluster, name, query, repeat):
+    expected = cluster.psql(query, INTERPRETER)
+    cluster.psql("SELECT pg_stat_copyjit_reset()")
+    result = cluster.psql(query, COPYJIT)
+    failures = cluster.psql("SELECT opcode || ' ' || failures FROM pg_stat_copyjit_failures() ORDER BY failures DESC")
+    fallbacks = int(cluster.psql("SELECT fallbacks FROM pg_stat_copyjit"))
+    differing = [] if result == expected else ["copyjit"]
+    differing += [variant for variant, options in VARIANTS.items() if cluster.psql(query, options) != expected]
+
+    interpreter_ms, _ = measure(cluster, query, INTERPRETER, repeat)
+    copyjit_ms, jit_ms = measure(cluster, query, COPYJIT, repeat)
+    return {
+        "query": name,
+        "results_match": not differing,
+        "differing": differing,
+        "rows": len(expected.splitlines()),
+        "interpreter_ms": round(interpreter_ms, 3),
+        "copyjit_ms": round(copyjit_ms, 3),
+        "copyjit_jit_ms": round(jit_ms, 3),
+        "speedup": round(interpreter_ms / copyjit_ms, 3) if copyjit_ms > 0 else None,
+        "unsupported_opcodes": failures.splitlines(),
+        "fallbacks": fallbacks,
+    }
+
+
+def parallel_template_hits(cluster):
+    """Templates of a forced parallel query found by its workers, instead of compiling the expressions again."""
+    cluster.psql("SELECT pg_stat_copyjit_reset()")
+    cluster.psql("SELECT count(*) FROM lineitem WHERE l_quantity < 24 AND l_discount BETWEEN 0.05 AND 0.07", PARALLEL)
+    return int(cluster.psql("SELECT template_hits FROM pg_stat_copyjit"))
+
+
+def check(report, baseline, max_regression):
+    """Returns the list of problems found in the report."""
+    problems = []
+    if report["parallel_template_hits"] == 0:
+        problems.append("parallel workers did not reuse any template of their leader")
+    previous = {}
+    if baseline:
+        with open(baseline) as f:
+            previous = {q["query"]: q for q in json.load(f)["queries"]}
+    for q in report["queries"]:
+        if not q["results_match"]:
+            problems.append("%s: results differ from the interpreter with %s" % (q["query"], ", ".join(q["differing"])))
+        if q["query"] in previous:
+            reference, against = previous[q["query"]]["copyjit_ms"], "the baseline"
+        elif baseline:
+            continue
+        else:
+            reference, against = q["interpreter_ms"], "the interpreter"
+        if q["copyjit_ms"] > reference * (1 + max_regression / 100):
+            problems.append("%s: %.3fms with copyjit, more than %g%% slower than %s (%.3fms)"
+                            % (q["query"], q["copyjit_ms"], max_regression, against, reference))
+    return problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--pg-config", default=os.environ.get("PG_CONFIG", "pg_config"))
+    parser.add_argument("--port", type=int, default=54330)
+    parser.add_argument("--scale", type=float, default=0.05, help="scale factor of the data (default 0.05)")
+    parser.add_argument("--repeat", type=int, default=5, help="runs of each query, the median is kept (default 5)")
+    parser.add_argument("--output", default=os.path.join(HERE, "results.json"))
+    parser.add_argument("--baseline", help="results of a previous run to compare with")
+    parser.add_argument("--max-regression", type=float, default=10,
+                        help="slowdown tolerated, in percent (default 10)")
+    parser.add_argument("queries", nargs="*", help="queries to run, by name (default all)")
+    args = parser.parse_args()
+
+    queries_dir = os.path.join(HERE, "queries")
+    names = args.queries or sorted(f[:-4] for f in os.listdir(queries_dir) if f.endswith(".sql"))
+
+    cluster = Cluster(args.pg_config, args.port)
+    try:
+        cluster.start()
+        cluster.psql(filename=os.path.join(HERE, "setup.sql"), variables={"sf": args.scale})
+        cluster.psql("CREATE EXTENSION copyjit")
+        report = {"scale": args.scale, "repeat": args.repeat, "queries": []}
+        print("%-12s %6s %12s %12s %10s %8s  %s" % ("query", "rows", "interp ms", "copyjit ms", "jit ms", "speedup",
+                                                   "unsupported"))
+        for name in names:
+            with open(os.path.join(queries_dir, name + ".sql")) as f:
+                q = run_query(cluster, name, f.read(), args.repeat)
+            report["queries"].append(q)
+            print("%-12s %6d %12.3f %12.3f %10.3f %8s  %s" % (
+                name, q["rows"], q["interpreter_ms"], q["copyjit_ms"], q["copyjit_jit_ms"],
+                q["speedup"] if q["results_match"] else "DIFFERS", ", ".join(q["unsupported_opcodes"])))
+        report["parallel_template_hits"] = parallel_template_hits(cluster)
+        print("Template hits of the parallel workers: %d" % report["parallel_template_hits"])
+    finally:
+        cluster.stop()
+
+    with open(args.output, "w") as f:
+        json.dump(report, f, indent=2)
+    print("Results written to %s" % args.output)
+
+    problems = check(report, args.baseline, args.max_regression)
+    for problem in problems:
+        print(problem, file=sys.stderr)
+    return 1 if problems else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
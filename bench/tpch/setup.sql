@@ -0,0 +1,80 @@
+-- TPC-H like schema and data, generated the same way on every run.
+-- The scale factor is given with psql -v sf=...
+SELECT setseed(0.42);
+
+CREATE TABLE region (r_regionkey integer PRIMARY KEY, r_name text NOT NULL);
+CREATE TABLE nation (n_nationkey integer PRIMARY KEY, n_name text NOT NULL, n_regionkey integer NOT NULL);
+CREATE TABLE supplier (s_suppkey integer PRIMARY KEY, s_name text NOT NULL, s_nationkey integer NOT NULL,
+	s_acctbal numeric(15, 2) NOT NULL);
+CREATE TABLE customer (c_custkey integer PRIMARY KEY, c_name text NOT NULL, c_nationkey integer NOT NULL,
+	c_acctbal numeric(15, 2) NOT NULL, c_mktsegment text NOT NULL, c_phone text NOT NULL);
+CREATE TABLE part (p_partkey integer PRIMARY KEY, p_name text NOT NULL, p_brand text NOT NULL, p_type text NOT NULL,
+	p_size integer NOT NULL, p_container text NOT NULL, p_retailprice numeric(15, 2) NOT NULL,
+	-- Not TPC-H: arrays of by-value elements and jsonb, for the stencils reading them
+	p_tags integer[] NOT NULL, p_stock bigint[] NOT NULL, p_attrs jsonb NOT NULL);
+CREATE TABLE partsupp (ps_partkey integer NOT NULL, ps_suppkey integer NOT NULL, ps_availqty integer NOT NULL,
+	ps_supplycost numeric(15, 2) NOT NULL, PRIMARY KEY (ps_partkey, ps_suppkey));
+CREATE TABLE orders (o_orderkey integer PRIMARY KEY, o_custkey integer NOT NULL, o_orderstatus char(1) NOT NULL,
+	o_totalprice numeric(15, 2) NOT NULL, o_orderdate date NOT NULL, o_orderpriority text NOT NULL,
+	o_shippriority integer NOT NULL);
+CREATE TABLE lineitem (l_orderkey integer NOT NULL, l_partkey integer NOT NULL, l_suppkey integer NOT NULL,
+	l_linenumber integer NOT NULL, l_quantity numeric(15, 2) NOT NULL, l_extendedprice numeric(15, 2) NOT NULL,
+	l_discount numeric(15, 2) NOT NULL, l_tax numeric(15, 2) NOT NULL, l_returnflag char(1) NOT NULL,
+	l_linestatus char(1) NOT NULL, l_shipdate date NOT NULL, l_commitdate date NOT NULL, l_receiptdate date NOT NULL,
+	l_shipinstruct text NOT NULL, l_shipmode text NOT NULL, PRIMARY KEY (l_orderkey, l_linenumber));
+
+SELECT (10000 * :sf)::integer AS suppliers, (150000 * :sf)::integer AS customers,
+	   (200000 * :sf)::integer AS parts, (1500000 * :sf)::integer AS orders \gset
+
+INSERT INTO region
+	SELECT r, (ARRAY['AFRICA', 'AMERICA', 'ASIA', 'EUROPE', 'MIDDLE EAST'])[r + 1] FROM generate_series(0, 4) AS r;
+INSERT INTO nation
+	SELECT n, 'NATION ' || n, n % 5 FROM generate_series(0, 24) AS n;
+INSERT INTO supplier
+	SELECT s, 'Supplier#' || s, (random() * 24)::integer, (random() * 10000 - 1000)::numeric(15, 2)
+	FROM generate_series(1, :suppliers) AS s;
+INSERT INTO customer
+	SELECT c, 'Customer#' || c, (random() * 24)::integer, (random() * 10000 - 1000)::numeric(15, 2),
+		   (ARRAY['AUTOMOBILE', 'BUILDING', 'FURNITURE', 'HOUSEHOLD', 'MACHINERY'])[1 + (random() * 4)::integer],
+		   (10 + (random() * 24)::integer) || '-' || (100 + (random() * 899)::integer)
+	FROM generate_series(1, :customers) AS c;
+INSERT INTO part
+	SELECT p, (ARRAY['green', 'blue', 'red', 'ivory', 'khaki'])[1 + p % 5] || ' part ' || p,
+		   'Brand#' || (1 + (random() * 4)::integer) || (1 + (random() * 4)::integer),
+		   (ARRAY['STANDARD', 'SMALL', 'MEDIUM', 'LARGE', 'PROMO'])[1 + (random() * 4)::integer] || ' ' ||
+		   (ARRAY['ANODIZED', 'BURNISHED', 'PLATED', 'POLISHED', 'BRUSHED'])[1 + (random() * 4)::integer] || ' ' ||
+		   (ARRAY['TIN', 'NICKEL', 'BRASS', 'STEEL', 'COPPER'])[1 + (random() * 4)::integer],
+		   1 + (random() * 49)::integer,
+		   (ARRAY['SM', 'MED', 'LG', 'JUMBO', 'WRAP'])[1 + (random() * 4)::integer] || ' ' ||
+		   (ARRAY['CASE', 'BOX', 'BAG', 'JAR', 'PACK'])[1 + (random() * 4)::integer],
+		   (900 + p % 1000 / 10.0)::numeric(15, 2),
+		   -- Computed from p only, the random values of the other columns stay the same
+		   ARRAY[p % 10, p % 7, p % 3],
+		   ARRAY[p::bigint * 3000000000, p % 1000],
+		   jsonb_build_object('color', (ARRAY['green', 'blue', 'red', 'ivory', 'khaki'])[1 + p % 5], 'weight', p % 50,
+							  'promo', p % 4 = 0)
+	FROM generate_series(1, :parts) AS p;
+INSERT INTO partsupp
+	SELECT p, 1 + (p + s * (:suppliers / 4)) % :suppliers, 1 + (random() * 9998)::integer,
+		   (1 + random() * 999)::numeric(15, 2)
+	FROM generate_series(1, :parts) AS p, generate_series(0, 3) AS s;
+INSERT INTO orders
+	SELECT o, 1 + (random() * (:customers - 1))::integer, (ARRAY['F', 'O', 'P'])[1 + (random() * 2)::integer],
+		   (1000 + random() * 400000)::numeric(15, 2), date '1992-01-01' + (random() * 2400)::integer,
+		   (ARRAY['1-URGENT', '2-HIGH', '3-MEDIUM', '4-NOT SPECIFIED', '5-LOW'])[1 + (random() * 4)::integer], 0
+	FROM generate_series(1, :orders) AS o;
+INSERT INTO lineitem
+	SELECT o_orderkey, p, 1 + (p + (l % 4) * (:suppliers / 4)) % :suppliers, l,
+		   q, q * (900 + p % 1000 / 10.0), (random() * 10)::integer / 100.0, (random() * 8)::integer / 100.0,
+		   CASE WHEN o_orderdate + 30 < date '1995-06-17' THEN (ARRAY['R', 'A'])[1 + (random())::integer] ELSE 'N' END,
+		   CASE WHEN o_orderdate + 30 < date '1995-06-17' THEN 'F' ELSE 'O' END,
+		   o_orderdate + 1 + l * 7, o_orderdate + 30 + l, o_orderdate + 10 + l * 8,
+		   (ARRAY['DELIVER IN PERSON', 'COLLECT COD', 'NONE', 'TAKE BACK RETURN'])[1 + (random() * 3)::integer],
+		   (ARRAY['REG AIR', 'AIR', 'RAIL', 'SHIP', 'TRUCK', 'MAIL', 'FOB'])[1 + (random() * 6)::integer]
+	FROM orders, generate_series(1, 1 + o_orderkey % 7) AS l,
+		 -- Referencing l draws new values for every line
+		 LATERAL (SELECT 1 + (random() * (:parts - 1))::integer + 0 * l AS p, 1 + (random() * 49)::integer AS q) AS r;
+
+CREATE INDEX ON lineitem (l_partkey);
+CREATE INDEX ON orders (o_custkey);
+VACUUM ANALYZE;
@@ -0,0 +1,62 @@
+/* copyjit--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION copyjit" to load this file. \quit
+
+CREATE FUNCTION pg_stat_copyjit(
+    OUT compiles bigint,
+    OUT failed_compiles bigint,
+    OUT fallbacks bigint,
+    OUT bytes_emitted bigint,
+    OUT template_hits bigint,
+    OUT template_misses bigint,
+    OUT compile_time_us bigint)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pg_stat_copyjit AS
+    SELECT * FROM pg_stat_copyjit();
+
+-- Compilations that failed, by the first unsupported opcode found
+CREATE FUNCTION pg_stat_copyjit_failures(
+    OUT opcode text,
+    OUT failures bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Histogram of the compile times, in microseconds, upper bound excluded
+CREATE FUNCTION pg_stat_copyjit_compile_times(
+    OUT lower_us bigint,
+    OUT upper_us bigint,
+    OUT compiles bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Memory held by each backend that compiled expressions
+CREATE FUNCTION pg_stat_copyjit_backends(
+    OUT pid integer,
+    OUT code_bytes bigint,
+    OUT arena_bytes bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Memory used by the current backend, even without shared_preload_libraries
+CREATE FUNCTION pg_copyjit_memory(
+    OUT code_regions integer,
+    OUT code_bytes bigint,
+    OUT arena_bytes bigint,
+    OUT pending_template_bytes bigint)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+CREATE FUNCTION pg_stat_copyjit_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION pg_stat_copyjit_reset() FROM PUBLIC;
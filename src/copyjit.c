@@ -5,19 +5,57 @@
  */
 #include "postgres.h"
 #include "fmgr.h"
+#include "funcapi.h"
 
+#include "access/htup_details.h"
+#include "access/parallel.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "common/hashfn.h"
 #include "jit/jit.h"
 #include "executor/execExpr.h"
+#include "executor/executor.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
 #include "nodes/execnodes.h"
+#if PG_VERSION_NUM >= 140000
+#include "nodes/subscripting.h"
+#endif
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "postmaster/autovacuum.h"
+#include "replication/walsender.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/dsa.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/guc.h"
+#include "utils/jsonb.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/tuplestore.h"
+#if PG_VERSION_NUM >= 170000
+#include "utils/resowner.h"
+#else
 #include "utils/resowner_private.h"
+#endif
 #include "utils/expandeddatum.h"
 #include "utils/fmgrprotos.h"
 
+#include <fcntl.h>
+#include <float.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "copyjit.h"
 
-void initialize_stencils();
 void copyjit_reset_after_error(void);
+bool copyjit_compile_expr(ExprState *state);
 
 #include "built-stencils.h"
 
@@ -27,208 +65,85 @@ void _PG_init(void);
 void _PG_fini(void);
 
 #define DEBUG_GEN 0
-#define SHOW_TIME 1
-
-static const char *opcodeNames[] = {
-	"EEOP_DONE",
-
-	/* apply slot_getsomeattrs on corresponding tuple slot */
-	"EEOP_INNER_FETCHSOME",
-	"EEOP_OUTER_FETCHSOME",
-	"EEOP_SCAN_FETCHSOME",
-
-	/* compute non-system Var value */
-	"EEOP_INNER_VAR",
-	"EEOP_OUTER_VAR",
-	"EEOP_SCAN_VAR",
-
-	/* compute system Var value */
-	"EEOP_INNER_SYSVAR",
-	"EEOP_OUTER_SYSVAR",
-	"EEOP_SCAN_SYSVAR",
-
-	/* compute wholerow Var */
-	"EEOP_WHOLEROW",
-
-	/*
-	 * Compute non-system Var value, assign it into ExprState's resultslot.
-	 * These are not used if a CheckVarSlotCompatibility() check would be
-	 * needed.
-	 */
-	"EEOP_ASSIGN_INNER_VAR",
-	"EEOP_ASSIGN_OUTER_VAR",
-	"EEOP_ASSIGN_SCAN_VAR",
-
-	/* assign ExprState's resvalue/resnull to a column of its resultslot */
-	"EEOP_ASSIGN_TMP",
-	/* ditto", applying MakeExpandedObjectReadOnly() */
-	"EEOP_ASSIGN_TMP_MAKE_RO",
-
-	/* evaluate Const value */
-	"EEOP_CONST",
-
-	/*
-	 * Evaluate function call (including OpExprs etc).  For speed", we
-	 * distinguish in the opcode whether the function is strict and/or
-	 * requires usage stats tracking.
-	 */
-	"EEOP_FUNCEXPR",
-	"EEOP_FUNCEXPR_STRICT",
-	"EEOP_FUNCEXPR_FUSAGE",
-	"EEOP_FUNCEXPR_STRICT_FUSAGE",
-
-	/*
-	 * Evaluate boolean AND expression", one step per subexpression. FIRST/LAST
-	 * subexpressions are special-cased for performance.  Since AND always has
-	 * at least two subexpressions", FIRST and LAST never apply to the same
-	 * subexpression.
-	 */
-	"EEOP_BOOL_AND_STEP_FIRST",
-	"EEOP_BOOL_AND_STEP",
-	"EEOP_BOOL_AND_STEP_LAST",
-
-	/* similarly for boolean OR expression */
-	"EEOP_BOOL_OR_STEP_FIRST",
-	"EEOP_BOOL_OR_STEP",
-	"EEOP_BOOL_OR_STEP_LAST",
-
-	/* evaluate boolean NOT expression */
-	"EEOP_BOOL_NOT_STEP",
-
-	/* simplified version of BOOL_AND_STEP for use by ExecQual() */
-	"EEOP_QUAL",
-
-	/* unconditional jump to another step */
-	"EEOP_JUMP",
-
-	/* conditional jumps based on current result value */
-	"EEOP_JUMP_IF_NULL",
-	"EEOP_JUMP_IF_NOT_NULL",
-	"EEOP_JUMP_IF_NOT_TRUE",
-
-	/* perform NULL tests for scalar values */
-	"EEOP_NULLTEST_ISNULL",
-	"EEOP_NULLTEST_ISNOTNULL",
-
-	/* perform NULL tests for row values */
-	"EEOP_NULLTEST_ROWISNULL",
-	"EEOP_NULLTEST_ROWISNOTNULL",
-
-	/* evaluate a BooleanTest expression */
-	"EEOP_BOOLTEST_IS_TRUE",
-	"EEOP_BOOLTEST_IS_NOT_TRUE",
-	"EEOP_BOOLTEST_IS_FALSE",
-	"EEOP_BOOLTEST_IS_NOT_FALSE",
-
-	/* evaluate PARAM_EXEC/EXTERN parameters */
-	"EEOP_PARAM_EXEC",
-	"EEOP_PARAM_EXTERN",
-	"EEOP_PARAM_CALLBACK",
-
-	/* return CaseTestExpr value */
-	"EEOP_CASE_TESTVAL",
-
-	/* apply MakeExpandedObjectReadOnly() to target value */
-	"EEOP_MAKE_READONLY",
-
-	/* evaluate assorted special-purpose expression types */
-	"EEOP_IOCOERCE",
-	"EEOP_DISTINCT",
-	"EEOP_NOT_DISTINCT",
-	"EEOP_NULLIF",
-	"EEOP_SQLVALUEFUNCTION",
-	"EEOP_CURRENTOFEXPR",
-	"EEOP_NEXTVALUEEXPR",
-	"EEOP_ARRAYEXPR",
-	"EEOP_ARRAYCOERCE",
-	"EEOP_ROW",
-
-	/*
-	 * Compare two individual elements of each of two compared ROW()
-	 * expressions.  Skip to ROWCOMPARE_FINAL if elements are not equal.
-	 */
-	"EEOP_ROWCOMPARE_STEP",
-
-	/* evaluate boolean value based on previous ROWCOMPARE_STEP operations */
-	"EEOP_ROWCOMPARE_FINAL",
-
-	/* evaluate GREATEST() or LEAST() */
-	"EEOP_MINMAX",
-
-	/* evaluate FieldSelect expression */
-	"EEOP_FIELDSELECT",
-
-	/*
-	 * Deform tuple before evaluating new values for individual fields in a
-	 * FieldStore expression.
-	 */
-	"EEOP_FIELDSTORE_DEFORM",
-
-	/*
-	 * Form the new tuple for a FieldStore expression.  Individual fields will
-	 * have been evaluated into columns of the tuple deformed by the preceding
-	 * DEFORM step.
-	 */
-	"EEOP_FIELDSTORE_FORM",
-
-	/* Process container subscripts; possibly short-circuit result to NULL */
-	"EEOP_SBSREF_SUBSCRIPTS",
-
-	/*
-	 * Compute old container element/slice when a SubscriptingRef assignment
-	 * expression contains SubscriptingRef/FieldStore subexpressions. Value is
-	 * accessed using the CaseTest mechanism.
-	 */
-	"EEOP_SBSREF_OLD",
-
-	/* compute new value for SubscriptingRef assignment expression */
-	"EEOP_SBSREF_ASSIGN",
-
-	/* compute element/slice for SubscriptingRef fetch expression */
-	"EEOP_SBSREF_FETCH",
-
-	/* evaluate value for CoerceToDomainValue */
-	"EEOP_DOMAIN_TESTVAL",
-
-	/* evaluate a domain's NOT NULL constraint */
-	"EEOP_DOMAIN_NOTNULL",
-
-	/* evaluate a single domain CHECK constraint */
-	"EEOP_DOMAIN_CHECK",
-
-	/* evaluate assorted special-purpose expression types */
-	"EEOP_CONVERT_ROWTYPE",
-	"EEOP_SCALARARRAYOP",
-	"EEOP_HASHED_SCALARARRAYOP",
-	"EEOP_XMLEXPR",
-	"EEOP_JSON_CONSTRUCTOR",
-	"EEOP_IS_JSON",
-	"EEOP_AGGREF",
-	"EEOP_GROUPING_FUNC",
-	"EEOP_WINDOW_FUNC",
-	"EEOP_SUBPLAN",
-
-	/* aggregation related nodes */
-	"EEOP_AGG_STRICT_DESERIALIZE",
-	"EEOP_AGG_DESERIALIZE",
-	"EEOP_AGG_STRICT_INPUT_CHECK_ARGS",
-	"EEOP_AGG_STRICT_INPUT_CHECK_NULLS",
-	"EEOP_AGG_PLAIN_PERGROUP_NULLCHECK",
-	"EEOP_AGG_PLAIN_TRANS_INIT_STRICT_BYVAL",
-	"EEOP_AGG_PLAIN_TRANS_STRICT_BYVAL",
-	"EEOP_AGG_PLAIN_TRANS_BYVAL",
-	"EEOP_AGG_PLAIN_TRANS_INIT_STRICT_BYREF",
-	"EEOP_AGG_PLAIN_TRANS_STRICT_BYREF",
-	"EEOP_AGG_PLAIN_TRANS_BYREF",
-	"EEOP_AGG_PRESORTED_DISTINCT_SINGLE",
-	"EEOP_AGG_PRESORTED_DISTINCT_MULTI",
-	"EEOP_AGG_ORDERED_TRANS_DATUM",
-	"EEOP_AGG_ORDERED_TRANS_TUPLE",
-
-	/* non-existent operation, used e.g. to check array lengths */
-	"EEOP_LAST"
+
+/*
+ * Offsets in the code are ints, and x86-64 jumps within the code of an
+ * expression are rel32: bound the code of an expression well below both.
+ */
+#define MAX_EXPRESSION_CODE_SIZE (1 << 30)
+
+#ifndef DLSUFFIX
+#define DLSUFFIX ".so"
+#endif
+
+#if PG_VERSION_NUM < 170000
+#define GetNumberFromPGProc(proc) ((proc)->pgprocno)
+#define MyProcNumber GetNumberFromPGProc(MyProc)
+#endif
+
+#if PG_VERSION_NUM < 180000
+#define EEOP_DONE_RETURN EEOP_DONE
+#endif
+
+/* GUCs */
+static int copyjit_tier_up_threshold = 0;
+static double copyjit_above_cost = 0;
+static int copyjit_min_steps = 3;
+static int copyjit_max_code_bytes = 0;
+static int copyjit_max_code_memory = 0;
+static double copyjit_memoize_min_cost = 0;
+static char *copyjit_template_store = NULL;
+
+typedef enum {
+	PERF_OUTPUT_OFF,
+	PERF_OUTPUT_MAP,
+	PERF_OUTPUT_JITDUMP
+} PerfOutput;
+
+static const struct config_enum_entry perf_output_options[] = {
+	{"off", PERF_OUTPUT_OFF, false},
+	{"map", PERF_OUTPUT_MAP, false},
+	{"jitdump", PERF_OUTPUT_JITDUMP, false},
+	{NULL, 0, false}
 };
 
+static int copyjit_perf_output = PERF_OUTPUT_OFF;
+static bool copyjit_explain_counters = false;
+static bool copyjit_profile = false;
+static int copyjit_pgo_evaluations = 0;
+
+/* Number of the last compiled expression, used to name it in perf symbols and profiles */
+static int expression_count = 0;
+
+/* Set while recompiling an expression with its profile, see recompile_with_profile */
+static bool recompiling = false;
+static const int *recompile_order = NULL;
+static int recompile_order_len = 0;
+
+/*
+ * An entry of recompile_order that is not a step: a jump to the step target,
+ * emitted elsewhere, around the steps moved out of line. Step 0 is never moved.
+ */
+#define ORDER_JUMP_TO(target)	(-(target))
+
+
+
+/*
+ * A stencil queued for copy in the generated code. All of them are copied and
+ * patched at once, when the final location of the code is known.
+ */
+typedef struct EmitRecord {
+	const struct Stencil *stencil;
+	int opno;		// step implemented by the stencil (the first one for merged steps)
+	int arg;		// stencil specific, e.g. argument checked by a strict checker
+	intptr_t data;	// stencil specific, e.g. a cache allocated with the expression
+	int offset;		// location of the stencil in the code
+} EmitRecord;
+
+typedef struct Trampoline {
+	intptr_t target;	// 0 for a free slot
+	int index;			// in the trampoline area
+} Trampoline;
 
 typedef struct CodeGen {
 	union Code {
@@ -238,28 +153,480 @@ typedef struct CodeGen {
 	} code;
 	int code_size;
 	int *offsets;
+	EmitRecord *records;
+	int record_count;
+	int required_trampolines;
 	int trampoline_count;	// count the number of initialized trampolines
-	intptr_t *trampoline_targets;
+	struct Trampoline *trampolines;	// hash table of the targets, see arm64_trampoline
+	int trampoline_mask;
+	int callout_steps;		// steps that only call the interpreter's implementation
+	int inlined_calls;		// function calls replaced by their code
+	int unsupported_opcode;	// set when the code can not be generated, -1 otherwise
+	struct ExprProfile *profile;	// counters of the profiling mode
 } CodeGen;
 
+/*
+ * State of find_common_calls, per step and per call.
+ */
+typedef struct CommonCallStep {
+	int min_jump_source;	// first step jumping here, INT_MAX if none
+	int jump_count;			// steps up to this one that are jumped to
+	int previous;			// earlier call with the same key, -1 if none
+	int key_slot;			// slot of the key of this call
+	int stack;				// calls that can still be reused, in step order
+} CommonCallStep;
+
+typedef struct CommonCallKey {
+	uint32 hash;
+	int key_step;			// a call with this key, -1 for an empty slot
+	int latest;				// latest call with this key that can be reused
+} CommonCallKey;
+
+typedef struct CommonCallWriter {
+	Datum *resvalue;
+	int opno;				// last step writing there
+} CommonCallWriter;
+
+/*
+ * Work buffers of the code generator. They live in TopMemoryContext and are
+ * kept from one compilation to the next, only growing when needed.
+ */
+static struct {
+	int *offsets;
+	int offsets_capacity;
+	bool *jump_targets;
+	int jump_targets_capacity;
+	EmitRecord *records;
+	int records_capacity;
+	struct StepShape *shape;
+	int shape_capacity;
+	int *common_calls;
+	int common_calls_capacity;
+	struct CommonCallStep *call_steps;
+	int call_steps_capacity;
+	struct CommonCallKey *call_keys;
+	int call_keys_capacity;
+	struct CommonCallWriter *call_writers;
+	int call_writers_capacity;
+} arena;
+
+static void
+arena_reserve(void **buffer, int *capacity, int needed, size_t item_size)
+{
+	int new_capacity;
+
+	if (needed <= *capacity)
+		return;
+	new_capacity = Max(Max(*capacity * 2, needed), 64);
+	if (*buffer)
+		*buffer = repalloc(*buffer, new_capacity * item_size);
+	else
+		*buffer = MemoryContextAlloc(TopMemoryContext, new_capacity * item_size);
+	*capacity = new_capacity;
+}
+
+/*
+ * The LLVM provider, used to recompile the expressions evaluated often enough.
+ * It is loaded on first use, only if tier-up is enabled.
+ */
+static enum {
+	LLVM_NOT_LOADED,
+	LLVM_LOADED,
+	LLVM_UNAVAILABLE
+} llvm_state = LLVM_NOT_LOADED;
+static JitProviderCallbacks llvm_callbacks;
+
+/*
+ * Our contexts owning an LLVM context. The core releases the LLVM contexts
+ * through us, they must be forwarded to the LLVM provider.
+ */
+static List *llvm_context_owners = NIL;
+
+static bool
+load_llvm_provider(void)
+{
+	char		path[MAXPGPATH];
+	struct stat st;
+	JitProviderInit init;
+
+	if (llvm_state != LLVM_NOT_LOADED)
+		return llvm_state == LLVM_LOADED;
+
+	llvm_state = LLVM_UNAVAILABLE;
+	// Same check as the core, loading a missing library would throw an error
+	snprintf(path, MAXPGPATH, "%s/llvmjit%s", pkglib_path, DLSUFFIX);
+	if (stat(path, &st) == -1) {
+		elog(DEBUG1, "copyjit tier-up disabled, %s is not available", path);
+		return false;
+	}
+	init = (JitProviderInit) load_external_function(path, "_PG_jit_provider_init", false, NULL);
+	if (init == NULL)
+		return false;
+	init(&llvm_callbacks);
+	llvm_state = LLVM_LOADED;
+	return true;
+}
+
 void
 copyjit_reset_after_error(void)
 {
+	if (llvm_state == LLVM_LOADED)
+		llvm_callbacks.reset_after_error();
 }
 
+/*
+ * A mapping of generated code. Every compiled expression gets its own, they
+ * are unmapped when the context is released or the code is replaced.
+ */
+typedef struct CodeRegion
+{
+	struct CodeRegion *next;
+	void *code;
+	size_t size;	// rounded up to the page size
+} CodeRegion;
+
 typedef struct CopyJitContext
 {
 	JitContext base;
-	void *code;
-	size_t code_size;
+	CodeRegion *regions;
+	JitContext *llvm_context;	// created on the first tier-up
+	/* reported with the instrumentation, JitInstrumentation has no room for them */
+	bool report_counters;
+	struct {
+		int64 compiled_steps;
+		int64 inlined_calls;
+		int64 callout_steps;
+		int64 code_bytes;
+		int64 fallbacks;	// expressions left to the interpreter
+	} counters;
+	MemoCache *memo_caches;		// counted when releasing the context
+	/* templates shared by a parallel leader with its workers */
+	enum {
+		TEMPLATES_UNKNOWN,
+		TEMPLATES_NONE,
+		TEMPLATES_LEADER,
+		TEMPLATES_WORKER
+	} templates_state;
+	dsa_area *templates;
+	dsa_pointer template_directory;
+	struct ExprProfile *profiles;	// dumped when releasing the context
 } CopyJitContext;
 
+/*
+ * Profiling mode
+ *
+ * With copyjit.profile, a counter is incremented before each step, and the
+ * strict checkers, QUAL and JUMP_IF_NOT_TRUE steps also count how often they
+ * skip the following steps. The counts are logged when the context is
+ * released.
+ */
+typedef struct ExprProfile
+{
+	struct ExprProfile *next;
+	int expression;
+	int steps_len;
+	int *opcodes;		// -1 for the steps merged with the previous ones
+	uint64 *counts;		// evaluations of each step
+	uint64 *branches;	// strict fails or early exits of each step
+} ExprProfile;
+
+static ExprProfile *
+create_profile(ExprState *state, int expression, MemoryContext cxt)
+{
+	ExprProfile *profile;
+	char *data;
+
+	data = MemoryContextAllocZero(cxt,
+								  MAXALIGN(sizeof(ExprProfile)) + state->steps_len * (sizeof(int) + 2 * sizeof(uint64)));
+	profile = (ExprProfile *) data;
+	profile->expression = expression;
+	profile->steps_len = state->steps_len;
+	profile->counts = (uint64 *) (data + MAXALIGN(sizeof(ExprProfile)));
+	profile->branches = profile->counts + state->steps_len;
+	profile->opcodes = (int *) (profile->branches + state->steps_len);
+	for (int opno = 0 ; opno < state->steps_len ; opno++)
+		profile->opcodes[opno] = state->steps[opno].opcode;
+	return profile;
+}
+
+static void
+dump_profile(const ExprProfile *profile)
+{
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+	for (int opno = 0 ; opno < profile->steps_len ; opno++) {
+		if (profile->opcodes[opno] < 0)
+			continue;
+		appendStringInfo(&buf, "\n%d %s: %llu", opno, opcodeNames[profile->opcodes[opno]],
+						 (unsigned long long) profile->counts[opno]);
+		if (profile->branches[opno])
+			appendStringInfo(&buf, ", %llu skips", (unsigned long long) profile->branches[opno]);
+	}
+	ereport(LOG,
+			(errmsg("copyjit profile of expression %d:%s", profile->expression, buf.data),
+			 errhidestmt(true)));
+	pfree(buf.data);
+}
+
+/*
+ * Shared memory, only available when loaded with shared_preload_libraries.
+ *
+ * It holds the statistics shown by pg_stat_copyjit and a slot per PGPROC. A
+ * backend leading a parallel query publishes in its slot the area holding the
+ * templates of the expressions it compiled.
+ */
+typedef struct BackendSlot
+{
+	int leader_pid;		// zero when no template is published
+	dsa_handle area;
+	dsa_pointer directory;
+	int pid;			// backend using the slot, zero when free
+	pg_atomic_uint64 code_bytes;	// currently mapped
+	pg_atomic_uint64 arena_bytes;
+} BackendSlot;
+
+// Compile times, bucket i counts the compiles that took [2^(i-1), 2^i) us
+#define COMPILE_TIME_BUCKETS 16
+
+typedef struct CopyJitShared
+{
+	pg_atomic_uint64 compiles;
+	pg_atomic_uint64 failed_compiles;	// because of an unsupported opcode
+	pg_atomic_uint64 fallbacks;			// declined by the cost model
+	pg_atomic_uint64 bytes_emitted;
+	pg_atomic_uint64 template_hits;
+	pg_atomic_uint64 template_misses;
+	pg_atomic_uint64 compile_time_us;
+	pg_atomic_uint64 compile_times[COMPILE_TIME_BUCKETS];
+	pg_atomic_uint64 unsupported[EEOP_LAST];
+	int template_tranche_id;	// of the template areas
+	int slot_count;
+	BackendSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} CopyJitShared;
+
+static CopyJitShared *shared = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+
+/*
+ * The area holding the templates of the parallel queries led by this backend.
+ * Created by the first one publishing a template and kept for the next ones,
+ * each leaving its own directory.
+ */
+static dsa_area *leader_area = NULL;
+static CopyJitContext *leading_context = NULL;	// the query publishing in leader_area
+
+static void retract_templates(CopyJitContext *context);
+
+static int
+shared_slot_count(void)
+{
+#if PG_VERSION_NUM >= 150000
+	return MaxBackends;
+#else
+	// MaxBackends is not computed yet when loading the libraries
+	return MaxConnections + autovacuum_max_workers + 1 + max_worker_processes + max_wal_senders;
+#endif
+}
+
+static Size
+shared_size(void)
+{
+	return add_size(offsetof(CopyJitShared, slots), mul_size(shared_slot_count(), sizeof(BackendSlot)));
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+copyjit_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+	RequestAddinShmemSpace(shared_size());
+}
+#endif
+
+static void
+copyjit_shmem_startup(void)
+{
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	shared = ShmemInitStruct("copyjit", shared_size(), &found);
+	if (!found) {
+		memset(shared, 0, shared_size());
+		pg_atomic_init_u64(&shared->compiles, 0);
+		pg_atomic_init_u64(&shared->failed_compiles, 0);
+		pg_atomic_init_u64(&shared->fallbacks, 0);
+		pg_atomic_init_u64(&shared->bytes_emitted, 0);
+		pg_atomic_init_u64(&shared->template_hits, 0);
+		pg_atomic_init_u64(&shared->template_misses, 0);
+		pg_atomic_init_u64(&shared->compile_time_us, 0);
+		for (int i = 0 ; i < COMPILE_TIME_BUCKETS ; i++)
+			pg_atomic_init_u64(&shared->compile_times[i], 0);
+		for (int i = 0 ; i < EEOP_LAST ; i++)
+			pg_atomic_init_u64(&shared->unsupported[i], 0);
+		shared->template_tranche_id = LWLockNewTrancheId();
+		shared->slot_count = shared_slot_count();
+		for (int i = 0 ; i < shared->slot_count ; i++) {
+			pg_atomic_init_u64(&shared->slots[i].code_bytes, 0);
+			pg_atomic_init_u64(&shared->slots[i].arena_bytes, 0);
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+static void
+release_backend_slot(int code, Datum arg)
+{
+	BackendSlot *slot = &shared->slots[DatumGetInt32(arg)];
+
+	slot->pid = 0;
+	pg_atomic_write_u64(&slot->code_bytes, 0);
+	pg_atomic_write_u64(&slot->arena_bytes, 0);
+}
+
+/*
+ * The slot of this backend, claimed on first use.
+ */
+static BackendSlot *
+my_backend_slot(void)
+{
+	static bool claimed = false;
+	int procno;
+
+	if (shared == NULL || MyProc == NULL)
+		return NULL;
+	procno = MyProcNumber;
+	if (procno >= shared->slot_count)
+		return NULL;
+	if (!claimed) {
+		shared->slots[procno].pid = MyProcPid;
+		pg_atomic_write_u64(&shared->slots[procno].code_bytes, 0);
+		pg_atomic_write_u64(&shared->slots[procno].arena_bytes, 0);
+		before_shmem_exit(release_backend_slot, Int32GetDatum(procno));
+		claimed = true;
+	}
+	return &shared->slots[procno];
+}
+
+/* Code mapped by this backend, in all its contexts */
+static size_t code_memory = 0;
+static int code_region_count = 0;
+
+static size_t
+mapped_size(size_t size)
+{
+	static size_t page_size = 0;
+
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return TYPEALIGN(page_size, size);
+}
+
+/*
+ * Map writable memory for the code of an expression, owned by the context.
+ */
+static void *
+map_code(CopyJitContext *context, size_t size)
+{
+	CodeRegion *region;
+	void *code;
+
+	region = MemoryContextAlloc(TopMemoryContext, sizeof(CodeRegion));
+	code = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		pfree(region);
+		elog(ERROR, "could not allocate %zu bytes of executable memory: %m", size);
+	}
+	region->code = code;
+	region->size = mapped_size(size);
+	region->next = context->regions;
+	context->regions = region;
+
+	code_memory += region->size;
+	code_region_count++;
+	if (my_backend_slot())
+		pg_atomic_fetch_add_u64(&my_backend_slot()->code_bytes, region->size);
+	return code;
+}
+
+/*
+ * Unmap the code of an expression, once nothing can run it anymore.
+ */
+static void
+unmap_code(CopyJitContext *context, void *code)
+{
+	CodeRegion **link = &context->regions;
+	CodeRegion *region;
+
+	while (*link && (*link)->code != code)
+		link = &(*link)->next;
+	if (*link == NULL)
+		elog(ERROR, "copyjit: no code mapped at %p", code);
+
+	region = *link;
+	*link = region->next;
+	munmap(region->code, region->size);
+	code_memory -= region->size;
+	code_region_count--;
+	if (my_backend_slot())
+		pg_atomic_fetch_sub_u64(&my_backend_slot()->code_bytes, region->size);
+	pfree(region);
+}
+
+/*
+ * The compiled code of an expression, and how many times it ran when tier-up
+ * is enabled. Allocated in the query context.
+ */
+typedef struct CompiledExpr
+{
+	void *code;
+	int calls;
+	int threshold;		// calls before recompiling, the GUC can change during execution
+	struct ExprProfile *profile;	// filled by the first evaluations, see copyjit.pgo_evaluations
+} CompiledExpr;
+
+#if PG_VERSION_NUM >= 170000
+/*
+ * Since PostgreSQL 17, each provider remembers its contexts in the resource
+ * owners with its own kind of resource.
+ */
+static void
+ResOwnerReleaseCopyJitContext(Datum res)
+{
+	JitContext *context = (JitContext *) DatumGetPointer(res);
+
+	context->resowner = NULL;
+	jit_release_context(context);
+}
+
+static const ResourceOwnerDesc copyjit_resowner_desc =
+{
+	.name = "copyjit JIT context",
+	.release_phase = RESOURCE_RELEASE_BEFORE_LOCKS,
+	.release_priority = RELEASE_PRIO_JIT_CONTEXTS,
+	.ReleaseResource = ResOwnerReleaseCopyJitContext,
+	.DebugPrint = NULL
+};
+#endif
+
 CopyJitContext *
 copyjit_create_context(int jitFlags)
 {
 	CopyJitContext *context;
 
+#if PG_VERSION_NUM >= 170000
+	ResourceOwnerEnlarge(CurrentResourceOwner);
+#else
 	ResourceOwnerEnlargeJIT(CurrentResourceOwner);
+#endif
 
 	context = MemoryContextAllocZero(TopMemoryContext,
 									 sizeof(CopyJitContext));
@@ -267,8 +634,12 @@ copyjit_create_context(int jitFlags)
 
 	/* ensure cleanup */
 	context->base.resowner = CurrentResourceOwner;
-	context->code = NULL;
+	context->regions = NULL;
+#if PG_VERSION_NUM >= 170000
+	ResourceOwnerRemember(CurrentResourceOwner, PointerGetDatum(context), &copyjit_resowner_desc);
+#else
 	ResourceOwnerRememberJIT(CurrentResourceOwner, PointerGetDatum(context));
+#endif
 
 	return context;
 }
@@ -276,16 +647,139 @@ copyjit_create_context(int jitFlags)
 void
 copyjit_release_context(JitContext *context)
 {
-	CopyJitContext *copyjit_context = (CopyJitContext *) context;
-	if (copyjit_context->code)
-		munmap(copyjit_context->code, copyjit_context->code_size);
+	CopyJitContext *copyjit_context;
+	ListCell   *lc;
+
+	foreach(lc, llvm_context_owners)
+	{
+		CopyJitContext *owner = (CopyJitContext *) lfirst(lc);
+
+		if (owner->llvm_context == context) {
+			llvm_context_owners = list_delete_ptr(llvm_context_owners, owner);
+			owner->llvm_context = NULL;
+			llvm_callbacks.release_context(context);
+			return;
+		}
+	}
+
+	copyjit_context = (CopyJitContext *) context;
+#if PG_VERSION_NUM >= 170000
+	// Before 17, jit_release_context forgets the context itself
+	if (context->resowner)
+		ResourceOwnerForget(context->resowner, PointerGetDatum(context), &copyjit_resowner_desc);
+#endif
+	while (copyjit_context->profiles) {
+		ExprProfile *profile = copyjit_context->profiles;
+
+		copyjit_context->profiles = profile->next;
+		dump_profile(profile);
+		pfree(profile);
+	}
+	while (copyjit_context->regions)
+		unmap_code(copyjit_context, copyjit_context->regions->code);
+	if (copyjit_context->templates_state == TEMPLATES_LEADER)
+		retract_templates(copyjit_context);
+	else if (copyjit_context->templates)
+		dsa_detach(copyjit_context->templates);
+	// The LLVM code is not used anymore either, no need to wait for the resource owner
+	if (copyjit_context->llvm_context)
+		jit_release_context(copyjit_context->llvm_context);
 }
 
+/*
+ * Report the counters of an instrumented execution once it completed, before
+ * its context is released. Nothing is reported when the query fails.
+ */
+static void
+copyjit_ExecutorEnd(QueryDesc *queryDesc)
+{
+	EState *estate = queryDesc->estate;
+	CopyJitContext *context = (CopyJitContext *) estate->es_jit;
+
+	if (context && strcmp(jit_provider, "copyjit") == 0 && context->report_counters) {
+		uint64 memo_hits = 0;
+		uint64 memo_misses = 0;
+
+		for (MemoCache *cache = context->memo_caches ; cache ; cache = cache->next) {
+			memo_hits += cache->hits;
+			memo_misses += cache->misses;
+		}
+		ereport(NOTICE,
+				(errmsg("copyjit: %lld steps compiled, %lld inlined calls, %lld call-outs, %lld bytes of code, %lld fallbacks",
+						(long long) context->counters.compiled_steps,
+						(long long) context->counters.inlined_calls,
+						(long long) context->counters.callout_steps,
+						(long long) context->counters.code_bytes,
+						(long long) context->counters.fallbacks),
+				 context->memo_caches ?
+				 errdetail("%llu memoized calls, %llu calls of the memoized functions.",
+						   (unsigned long long) memo_hits, (unsigned long long) memo_misses) : 0));
+	}
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
 
 static Datum
 ExecRunCompiledExpr(ExprState *state, ExprContext *econtext, bool *isNull)
 {
-	return ((ExprStateEvalFunc) state->evalfunc_private) (state, econtext, isNull);
+	return ((ExprStateEvalFunc) ((CompiledExpr *) state->evalfunc_private)->code) (state, econtext, isNull);
+}
+
+/*
+ * Recompile the expression with LLVM. The LLVM provider expects es_jit to be
+ * one of its contexts, so it is swapped with the one kept for this query.
+ */
+static bool
+copyjit_tier_up(ExprState *state)
+{
+	EState	   *estate = state->parent->state;
+	CopyJitContext *context = (CopyJitContext *) estate->es_jit;
+	MemoryContext oldcontext;
+	bool		compiled = false;
+
+	estate->es_jit = context->llvm_context;
+	// We are called during evaluation, in a short-lived context
+	oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
+	PG_TRY();
+	{
+		compiled = llvm_callbacks.compile_expr(state);
+	}
+	PG_FINALLY();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		if (estate->es_jit && context->llvm_context == NULL) {
+			context->llvm_context = estate->es_jit;
+			oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+			llvm_context_owners = lappend(llvm_context_owners, context);
+			MemoryContextSwitchTo(oldcontext);
+		}
+		// EXPLAIN and the parallel workers only look at the instrumentation of es_jit
+		if (context->llvm_context) {
+			InstrJitAgg(&context->base.instr, &context->llvm_context->instr);
+			memset(&context->llvm_context->instr, 0, sizeof(JitInstrumentation));
+		}
+		estate->es_jit = &context->base;
+	}
+	PG_END_TRY();
+	return compiled;
+}
+
+static Datum
+ExecRunCompiledExprCounting(ExprState *state, ExprContext *econtext, bool *isNull)
+{
+	CompiledExpr *compiled = (CompiledExpr *) state->evalfunc_private;
+
+	if (++compiled->calls >= compiled->threshold) {
+		// On success, the LLVM provider replaced evalfunc and evalfunc_private
+		if (copyjit_tier_up(state)) {
+			unmap_code((CopyJitContext *) state->parent->state->es_jit, compiled->code);
+			return state->evalfunc(state, econtext, isNull);
+		}
+		state->evalfunc = ExecRunCompiledExpr;
+	}
+	return ((ExprStateEvalFunc) compiled->code) (state, econtext, isNull);
 }
 
 #if defined(__aarch64__) || defined(_M_ARM64)
@@ -311,44 +805,61 @@ static void build_aarch64_trampoline(uint32_t *code, intptr_t target)
 	code[3] = target >> 32;
 }
 
+// B and BL reach +/-128MB, in instructions
+#define ARM64_X26_RANGE (1 << 25)
+
+/*
+ * Trampoline built for target, reusing the one built for an earlier call to
+ * the same target. The trampolines are found through an open addressing hash
+ * table, the number of calls can be large.
+ */
+static uint32_t *
+arm64_trampoline(CodeGen *codeGen, intptr_t target)
+{
+	uint32_t h = (uint32_t) (((uint64_t) target >> 2) * UINT64CONST(0x9E3779B97F4A7C15) >> 32);
+	struct Trampoline *slot;
+
+	for (;;) {
+		slot = &codeGen->trampolines[h & codeGen->trampoline_mask];
+		if (slot->target == target || slot->target == 0)
+			break;
+		h++;
+	}
+	if (slot->target == 0) {
+		// The target has not yet been 'trampolined', let's do it
+		if (codeGen->trampoline_count >= codeGen->required_trampolines)
+			elog(ERROR, "copyjit: more trampolines needed than the %i reserved", codeGen->required_trampolines);
+		slot->target = target;
+		slot->index = codeGen->trampoline_count++;
+		// The trampolines are after the code
+		build_aarch64_trampoline(codeGen->code.as_u32 + codeGen->code_size / 4 + slot->index * (TRAMPOLINE_SIZE / 4), target);
+	}
+	return codeGen->code.as_u32 + codeGen->code_size / 4 + slot->index * (TRAMPOLINE_SIZE / 4);
+}
+
 static void apply_arm64_x26 (CodeGen *codeGen, size_t u32offset, intptr_t target)
 {
-	intptr_t current_address = &(codeGen->code.as_u32[u32offset]);
-	uint32_t delta = (target - current_address) / 4;
-	if ((delta < (1 << 26)) && (delta > -(1 << 26))) {
-		if (DEBUG_GEN) {
-			elog(WARNING, "*** Jump does not require a trampoline***");
-			elog(WARNING, "==> Delta = %p for %p - %p", delta, target, current_address);
-		}
-	else {
-		if (DEBUG_GEN)
-			elog(WARNING, "Asked to create a trampoline targeting %p for offset %p", target, u32offset);
-		uint32_t *trampoline_address = codeGen->code.as_u32 + codeGen->code_size / 4;	// Target the beginning of trampoline area, after code
-		int t;
-		for (t = 0 ; t < codeGen->trampoline_count ; t++) {
-			trampoline_address += (TRAMPOLINE_SIZE / 4);
-			if (codeGen->trampoline_targets[t] == target)
-				break;
-		}
+	intptr_t current_address = (intptr_t) &(codeGen->code.as_u32[u32offset]);
+	int64_t delta = (target - current_address) / 4;
+
+	if (delta < ARM64_X26_RANGE && delta >= -ARM64_X26_RANGE) {
 		if (DEBUG_GEN)
-			elog(WARNING, "=> Going to use trampoline %x, at %p", t, trampoline_address);
-		if (t == codeGen->trampoline_count) {
-			// The target has not yet been 'trampolined', let's do it
-			build_aarch64_trampoline(trampoline_address, target);
-			codeGen->trampoline_targets[t] = target;
-			codeGen->trampoline_count++;
-		}
+			elog(WARNING, "==> Delta = %lld for %p - %p, no trampoline needed", (long long) delta, (void *) target, (void *) current_address);
+	} else {
+		uint32_t *trampoline_address = arm64_trampoline(codeGen, target);
+
 		// Now we can code a 26bits delta using the offset between codeGen->code+u32offset and trampoline_address
-		delta = (((intptr_t) trampoline_address) - current_address) /4;
+		delta = (((intptr_t) trampoline_address) - current_address) / 4;
 		if (DEBUG_GEN)
-			elog(WARNING, "=> Delta = %p for %p - %p", delta, trampoline_address, current_address);
-		if (delta > (1 << 26) || delta < -(1 << 26))
-			elog(WARNING, "Computed delta, %p, from %p to %p, is far too big", delta, current_address, trampoline_address);
+			elog(WARNING, "=> Delta = %lld for %p - %p", (long long) delta, trampoline_address, (void *) current_address);
+		// worth_emitting keeps the code and its trampolines within reach
+		if (delta >= ARM64_X26_RANGE || delta < -ARM64_X26_RANGE)
+			elog(ERROR, "copyjit: trampoline at %p out of reach of %p", trampoline_address, (void *) current_address);
 	}
 	// Force instruction target bits to 0, for safety
 	codeGen->code.as_u32[u32offset] &= 0xFC000000;
 	// Now encode the delta in there
-	codeGen->code.as_u32[u32offset] |= (delta & ~0xFC000000);
+	codeGen->code.as_u32[u32offset] |= ((uint32_t) delta & ~0xFC000000);
 }
 
 #elif defined(__x86_64__)
@@ -362,112 +873,803 @@ static void apply_arm64_x26 (CodeGen *codeGen, size_t u32offset, intptr_t target
 
 #endif
 
-static intptr_t get_patch_target(ExprState *state, CodeGen *codeGen, size_t next_offset, struct ExprEvalStep *op, const struct Patch *patch)
+/*
+ * The function called by a step, for the steps calling one through FUNC_CALL.
+ */
+static PGFunction
+step_function(struct ExprEvalStep *op)
 {
-	intptr_t target;
-	switch (patch->target) {
-		case TARGET_CONST_ISNULL:
-			target = op->d.constval.isnull;
-			break;
-		case TARGET_CONST_VALUE:
-			target = op->d.constval.value;
-			break;
-		case TARGET_RESULTNUM:
-			target = op->d.assign_tmp.resultnum;
-			break;
-		case TARGET_OP:
-			target = (intptr_t) op;
-			break;
-		case TARGET_MakeExpandedObjectReadOnlyInternal:
-			target = (intptr_t) &MakeExpandedObjectReadOnlyInternal;
-			break;
-		case TARGET_ExecEvalScalarArrayOp:
-			target = (intptr_t) &ExecEvalScalarArrayOp;
-			break;
-		case TARGET_ExecEvalSysVar:
-			target = (intptr_t) &ExecEvalSysVar;
-			break;
-		case TARGET_ExecEvalSQLValueFunction:
-			target = (intptr_t) &ExecEvalSQLValueFunction;
-			break;
-		case TARGET_ExecEvalParamExec:
-			target = (intptr_t) &ExecEvalParamExec;
-			break;
-		case TARGET_ExecEvalParamExtern:
-			target = (intptr_t) &ExecEvalParamExtern;
-			break;
-		case TARGET_slot_getsomeattrs_int:
-			target = (intptr_t) &slot_getsomeattrs_int;
-			break;
-		case TARGET_FORCE_NEXT_CALL:
-		case TARGET_NEXT_CALL:
-			target = (intptr_t) codeGen->code.as_void + next_offset;
-			break;
-		case TARGET_JUMP_DONE:
-			target = (intptr_t) codeGen->code.as_void + codeGen->offsets[op->d.qualexpr.jumpdone];
-			break;
-		case TARGET_JUMP_NULL:
-			if (op->opcode == EEOP_AGG_PLAIN_PERGROUP_NULLCHECK)
-				target = (intptr_t) codeGen->code.as_void + codeGen->offsets[op->d.agg_plain_pergroup_nullcheck.jumpnull];
-			else if (op->opcode == EEOP_AGG_STRICT_INPUT_CHECK_ARGS)
-				target = (intptr_t) codeGen->code.as_void + codeGen->offsets[op->d.agg_strict_input_check.jumpnull];
-			else
-				elog(ERROR, "Unsupported target TARGET_JUMP_NULL in opcode %s", opcodeNames[op->opcode]);
-			break;
-		case TARGET_RESULTSLOT_VALUES:
-			if (op->opcode == EEOP_ASSIGN_TMP || op->opcode == EEOP_ASSIGN_TMP_MAKE_RO)
-				target = (intptr_t) &(state->resultslot->tts_values[op->d.assign_tmp.resultnum]);
-			else if (op->opcode == EEOP_ASSIGN_SCAN_VAR || op->opcode == EEOP_ASSIGN_INNER_VAR || op->opcode == EEOP_ASSIGN_OUTER_VAR)
-				target = (intptr_t) &(state->resultslot->tts_values[op->d.assign_var.resultnum]);
-			else
-				elog(ERROR, "Unsupported target TARGET_RESULTSLOT_VALUES in opcode %s", opcodeNames[op->opcode]);
-			break;
-		case TARGET_RESULTSLOT_ISNULL:
-			if (op->opcode == EEOP_ASSIGN_TMP || op->opcode == EEOP_ASSIGN_TMP_MAKE_RO)
-				target = (intptr_t) &(state->resultslot->tts_isnull[op->d.assign_tmp.resultnum]);
-			else if (op->opcode == EEOP_ASSIGN_SCAN_VAR || op->opcode == EEOP_ASSIGN_INNER_VAR || op->opcode == EEOP_ASSIGN_OUTER_VAR)
-				target = (intptr_t) &(state->resultslot->tts_isnull[op->d.assign_var.resultnum]);
-			else
-				elog(ERROR, "Unsupported target TARGET_RESULTSLOT_ISNULL in opcode %s", opcodeNames[op->opcode]);
-			break;
-		case TARGET_FUNC_CALL:
-			target = (intptr_t) op->d.func.fn_addr;
-			break;
-		case TARGET_FUNC_NARGS:
-			target = (intptr_t) op->d.func.nargs;
-			break;
-		case TARGET_ATTNUM:
-			if (op->opcode == EEOP_ASSIGN_SCAN_VAR || op->opcode == EEOP_ASSIGN_INNER_VAR || op->opcode == EEOP_ASSIGN_OUTER_VAR)
-				target = op->d.assign_var.attnum;
-			else if (op->opcode == EEOP_SCAN_VAR)
-				target = op->d.var.attnum;
-			else
-				elog(ERROR, "Unsupported target TARGET_ATTNUM in opcode %s", opcodeNames[op->opcode]);
+	switch (op->opcode) {
+#if PG_VERSION_NUM >= 180000
+		case EEOP_HASHDATUM_FIRST:
+		case EEOP_HASHDATUM_FIRST_STRICT:
+		case EEOP_HASHDATUM_NEXT32:
+		case EEOP_HASHDATUM_NEXT32_STRICT:
+			return op->d.hashdatum.fn_addr;
+#endif
+		default:
+			return op->d.func.fn_addr;
+	}
+}
+
+/*
+ * Fill targets with the steps op can jump to, returns their count.
+ */
+static int
+step_jump_targets(struct ExprEvalStep *op, int *targets)
+{
+	switch (op->opcode) {
+		case EEOP_BOOL_AND_STEP_FIRST:
+		case EEOP_BOOL_AND_STEP:
+		case EEOP_BOOL_AND_STEP_LAST:
+		case EEOP_BOOL_OR_STEP_FIRST:
+		case EEOP_BOOL_OR_STEP:
+		case EEOP_BOOL_OR_STEP_LAST:
+			targets[0] = op->d.boolexpr.jumpdone;
+			return 1;
+		case EEOP_QUAL:
+			targets[0] = op->d.qualexpr.jumpdone;
+			return 1;
+		case EEOP_JUMP:
+		case EEOP_JUMP_IF_NULL:
+		case EEOP_JUMP_IF_NOT_NULL:
+		case EEOP_JUMP_IF_NOT_TRUE:
+			targets[0] = op->d.jump.jumpdone;
+			return 1;
+		case EEOP_ROWCOMPARE_STEP:
+			targets[0] = op->d.rowcompare_step.jumpnull;
+			targets[1] = op->d.rowcompare_step.jumpdone;
+			return 2;
+		case EEOP_SBSREF_SUBSCRIPTS:
+			targets[0] = op->d.sbsref_subscript.jumpdone;
+			return 1;
+		case EEOP_AGG_STRICT_DESERIALIZE:
+			targets[0] = op->d.agg_deserialize.jumpnull;
+			return 1;
+		case EEOP_AGG_STRICT_INPUT_CHECK_ARGS:
+		case EEOP_AGG_STRICT_INPUT_CHECK_NULLS:
+			targets[0] = op->d.agg_strict_input_check.jumpnull;
+			return 1;
+		case EEOP_AGG_PLAIN_PERGROUP_NULLCHECK:
+			targets[0] = op->d.agg_plain_pergroup_nullcheck.jumpnull;
+			return 1;
+#if PG_VERSION_NUM >= 160000
+		case EEOP_AGG_PRESORTED_DISTINCT_SINGLE:
+		case EEOP_AGG_PRESORTED_DISTINCT_MULTI:
+			targets[0] = op->d.agg_presorted_distinctcheck.jumpdistinct;
+			return 1;
+#endif
+#if PG_VERSION_NUM >= 180000
+		case EEOP_HASHDATUM_FIRST_STRICT:
+		case EEOP_HASHDATUM_NEXT32_STRICT:
+			targets[0] = op->d.hashdatum.jumpdone;
+			return 1;
+#endif
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Number of consecutive ASSIGN_*_VAR steps of the same kind starting at opno.
+ * A run stops before any jump target, since the whole run becomes a single
+ * stencil.
+ */
+static int
+assign_var_run_length(ExprState *state, int opno, const bool *jump_targets)
+{
+	ExprEvalOp opcode = state->steps[opno].opcode;
+	int length = 1;
+
+	if (opcode != EEOP_ASSIGN_SCAN_VAR && opcode != EEOP_ASSIGN_INNER_VAR && opcode != EEOP_ASSIGN_OUTER_VAR)
+		return 0;
+	while (opno + length < state->steps_len
+		   && state->steps[opno + length].opcode == opcode
+		   && !jump_targets[opno + length])
+		length++;
+	return length;
+}
+
+static bool
+assign_var_run_is_contiguous(ExprState *state, int opno, int length)
+{
+	struct ExprEvalStep *first = &state->steps[opno];
+
+	for (int i = 1 ; i < length ; i++) {
+		struct ExprEvalStep *op = &state->steps[opno + i];
+		if (op->d.assign_var.attnum != first->d.assign_var.attnum + i ||
+			op->d.assign_var.resultnum != first->d.assign_var.resultnum + i)
+			return false;
+	}
+	return true;
+}
+
+static const struct Stencil *
+assign_var_run_stencil(ExprEvalOp opcode, bool contiguous)
+{
+	switch (opcode) {
+		case EEOP_ASSIGN_SCAN_VAR:
+			return contiguous ? &extra_EEOP_ASSIGN_SCAN_VAR_BLOCK : &extra_EEOP_ASSIGN_SCAN_VAR_TABLE;
+		case EEOP_ASSIGN_INNER_VAR:
+			return contiguous ? &extra_EEOP_ASSIGN_INNER_VAR_BLOCK : &extra_EEOP_ASSIGN_INNER_VAR_TABLE;
+		case EEOP_ASSIGN_OUTER_VAR:
+			return contiguous ? &extra_EEOP_ASSIGN_OUTER_VAR_BLOCK : &extra_EEOP_ASSIGN_OUTER_VAR_TABLE;
+		default:
+			elog(ERROR, "Unsupported opcode %s for an assignment run", opcodeNames[opcode]);
+	}
+	return NULL;
+}
+
+/*
+ * Can this PARAM_EXTERN be read directly from the parameter list?
+ * This requires a static list (no paramFetch hook) with an already valid
+ * parameter of the expected type.
+ */
+static bool
+param_extern_is_static(ExprState *state, struct ExprEvalStep *op)
+{
+	ParamListInfo params = state->parent->state->es_param_list_info;
+	int paramid = op->d.param.paramid;
+	ParamExternData *prm;
+
+	if (params == NULL || params->paramFetch != NULL)
+		return false;
+	if (paramid <= 0 || paramid > params->numParams)
+		return false;
+	prm = &params->params[paramid - 1];
+	return OidIsValid(prm->ptype) && prm->ptype == op->d.param.paramtype;
+}
+
+#if PG_VERSION_NUM >= 140000
+/*
+ * Leading fields of the private workspace of the array subscripts, see
+ * ArraySubWorkspace in arraysubs.c.
+ */
+typedef struct ArraySubWorkspacePrefix
+{
+	Oid refelemtype;
+	int16 refattrlength;
+} ArraySubWorkspacePrefix;
+
+/*
+ * The functions of the array subscripts are static, ask the array type for
+ * them once per backend.
+ */
+static bool
+is_array_subscript(SubscriptingRefState *sbsrefstate, ExecEvalBoolSubroutine check_subscripts, ExecEvalSubroutine fetch)
+{
+	static SubscriptExecSteps array_steps;
+
+	if (array_steps.sbs_check_subscripts == NULL) {
+		const SubscriptRoutines *routines = (const SubscriptRoutines *) DatumGetPointer(DirectFunctionCall1(array_subscript_handler, (Datum) 0));
+		SubscriptingRef *sbsref = makeNode(SubscriptingRef);
+		SubscriptingRefState *dummy = palloc0(sizeof(SubscriptingRefState));
+		SubscriptExecSteps steps = {0};
+
+		sbsref->refcontainertype = INT4ARRAYOID;
+		sbsref->refelemtype = INT4OID;
+		sbsref->refrestype = INT4OID;
+		sbsref->reftypmod = -1;
+		dummy->numupper = 1;
+		routines->exec_setup(sbsref, dummy, &steps);
+		pfree(dummy->workspace);
+		pfree(dummy);
+		pfree(sbsref);
+		array_steps = steps;
+	}
+	return check_subscripts == array_steps.sbs_check_subscripts && fetch == array_steps.sbs_fetch;
+}
+
+/*
+ * Can this SBSREF_SUBSCRIPTS be compiled with the following SBSREF_FETCH as
+ * extra_EEOP_SBSREF_ARRAY_FETCH? They must read a single element of a varlena
+ * array, with one subscript. Jumps to the fetch are checked by the caller.
+ */
+static bool
+sbsref_array_fetch_fusable(ExprState *state, int opno)
+{
+	struct ExprEvalStep *op = &state->steps[opno];
+	struct ExprEvalStep *fetch = op + 1;
+	SubscriptingRefState *sbsrefstate = op->d.sbsref_subscript.state;
+
+	if (op->opcode != EEOP_SBSREF_SUBSCRIPTS || opno + 1 >= state->steps_len)
+		return false;
+	if (fetch->opcode != EEOP_SBSREF_FETCH || fetch->d.sbsref.state != sbsrefstate)
+		return false;
+	if (sbsrefstate->numupper != 1 || sbsrefstate->numlower != 0 || !sbsrefstate->upperprovided[0])
+		return false;
+	if (!is_array_subscript(sbsrefstate, op->d.sbsref_subscript.subscriptfunc, fetch->d.sbsref.subscriptfunc))
+		return false;
+	// Fixed-length types subscripted like arrays (point, name) have no array header
+	return ((ArraySubWorkspacePrefix *) sbsrefstate->workspace)->refattrlength == -1;
+}
+#endif
+
+/*
+ * Are the results of this FUNCEXPR step worth keeping for the next calls with
+ * the same arguments? The function must be immutable, cost at least
+ * copyjit.memoize_min_cost, and only take and return by-value or varlena
+ * types.
+ */
+static bool
+function_is_memoizable(struct ExprEvalStep *op)
+{
+	FmgrInfo *flinfo;
+	int16 typlen;
+	bool typbyval;
+	Oid rettype;
+
+	if (copyjit_memoize_min_cost <= 0)
+		return false;
+	if (op->opcode != EEOP_FUNCEXPR && op->opcode != EEOP_FUNCEXPR_STRICT)
+		return false;
+	if (op->d.func.nargs < 1 || op->d.func.nargs > MEMO_MAX_ARGS)
+		return false;
+	flinfo = op->d.func.finfo;
+	if (flinfo->fn_retset || func_volatile(flinfo->fn_oid) != PROVOLATILE_IMMUTABLE)
+		return false;
+	if (get_func_cost(flinfo->fn_oid) < copyjit_memoize_min_cost)
+		return false;
+	// The types are taken from the call, polymorphic functions included
+	rettype = get_fn_expr_rettype(flinfo);
+	if (!OidIsValid(rettype))
+		return false;
+	get_typlenbyval(rettype, &typlen, &typbyval);
+	if (!typbyval && typlen != -1)
+		return false;
+	for (int argno = 0 ; argno < op->d.func.nargs ; argno++) {
+		Oid argtype = get_fn_expr_argtype(flinfo, argno);
+
+		if (!OidIsValid(argtype))
+			return false;
+		get_typlenbyval(argtype, &typlen, &typbyval);
+		if (!typbyval && typlen != -1)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * The stencil of a jsonb -> or ->> step with a constant key, NULL for any
+ * other step. The key must be set by the CONST step right before.
+ */
+static const struct Stencil *
+jsonb_const_key_stencil(ExprState *state, int opno)
+{
+	struct ExprEvalStep *op = &state->steps[opno];
+	struct ExprEvalStep *key;
+	const struct Stencil *stencil;
+
+	if (op->opcode != EEOP_FUNCEXPR_STRICT || op->d.func.nargs != 2 || opno == 0)
+		return NULL;
+	if (op->d.func.fn_addr == &jsonb_object_field)
+		stencil = &extra_EEOP_FUNCEXPR_STRICT_jsonb_object_field;
+	else if (op->d.func.fn_addr == &jsonb_object_field_text)
+		stencil = &extra_EEOP_FUNCEXPR_STRICT_jsonb_object_field_text;
+	else
+		return NULL;
+	key = op - 1;
+	if (key->opcode != EEOP_CONST || key->d.constval.isnull || key->resvalue != &op->d.func.fcinfo_data->args[1].value)
+		return NULL;
+	return stencil;
+}
+
+/*
+ * Common calls
+ *
+ * A projection or a qual often calls the same immutable function on the same
+ * columns several times, like lower(email) in both the target list and the
+ * WHERE clause. The arguments of such a call are computed by the steps right
+ * before it, writing in its fcinfo. When an earlier identical call always runs
+ * first, the later call and its arguments are replaced by a copy of the
+ * earlier result.
+ */
+static bool
+is_leaf_step(struct ExprEvalStep *op)
+{
+	switch (op->opcode) {
+		case EEOP_INNER_VAR:
+		case EEOP_OUTER_VAR:
+		case EEOP_SCAN_VAR:
+		case EEOP_CONST:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * First step of a call whose arguments are all columns or constants, -1 if
+ * opno is not such a call.
+ */
+static int
+leaf_call_start(ExprState *state, int opno)
+{
+	struct ExprEvalStep *op = &state->steps[opno];
+	int nargs;
+
+	if (op->opcode != EEOP_FUNCEXPR && op->opcode != EEOP_FUNCEXPR_STRICT)
+		return -1;
+	nargs = op->d.func.nargs;
+	if (nargs == 0 || nargs > opno)
+		return -1;
+	for (int argno = 0 ; argno < nargs ; argno++) {
+		struct ExprEvalStep *arg = &state->steps[opno - nargs + argno];
+
+		if (!is_leaf_step(arg) ||
+			arg->resvalue != &op->d.func.fcinfo_data->args[argno].value ||
+			arg->resnull != &op->d.func.fcinfo_data->args[argno].isnull)
+			return -1;
+	}
+	return opno - nargs;
+}
+
+static inline uint32
+hash_word(uint64 value)
+{
+	return hash_combine(murmurhash32((uint32) value), murmurhash32((uint32) (value >> 32)));
+}
+
+/*
+ * Hash of the call opno whose arguments are all columns or constants, false if
+ * the call can not be compared, its constants having no known type.
+ */
+static bool
+leaf_call_hash(ExprState *state, int opno, uint32 *hash)
+{
+	struct ExprEvalStep *op = &state->steps[opno];
+	int nargs = op->d.func.nargs;
+	uint32 result = hash_word((uint64) (uintptr_t) op->d.func.fn_addr);
+
+	result = hash_combine(result, murmurhash32(nargs));
+	result = hash_combine(result, murmurhash32(op->d.func.fcinfo_data->fncollation));
+	for (int argno = 0 ; argno < nargs ; argno++) {
+		struct ExprEvalStep *arg = op - nargs + argno;
+
+		result = hash_combine(result, murmurhash32(arg->opcode));
+		if (arg->opcode == EEOP_CONST) {
+			Oid argtype;
+			int16 typlen;
+			bool typbyval;
+
+			if (arg->d.constval.isnull)
+				continue;
+			if (op->d.func.finfo == NULL || op->d.func.finfo->fn_expr == NULL)
+				return false;
+			argtype = get_fn_expr_argtype(op->d.func.finfo, argno);
+			if (!OidIsValid(argtype))
+				return false;
+			get_typlenbyval(argtype, &typlen, &typbyval);
+			// Consistent with datumIsEqual, comparing the raw bytes
+			if (typbyval)
+				result = hash_combine(result, hash_word((uint64) arg->d.constval.value));
+			else
+				result = hash_combine(result, hash_bytes((const unsigned char *) DatumGetPointer(arg->d.constval.value),
+														 datumGetSize(arg->d.constval.value, typbyval, typlen)));
+		} else {
+			result = hash_combine(result, murmurhash32(arg->d.var.attnum));
+			result = hash_combine(result, murmurhash32(arg->d.var.vartype));
+		}
+	}
+	*hash = result;
+	return true;
+}
+
+/*
+ * Whether the calls first and second, both with a leaf_call_hash, compute the
+ * same function on the same arguments. The function still has to be checked to
+ * be immutable.
+ */
+static bool
+same_leaf_call(ExprState *state, int first, int second)
+{
+	struct ExprEvalStep *op1 = &state->steps[first];
+	struct ExprEvalStep *op2 = &state->steps[second];
+	int nargs = op1->d.func.nargs;
+
+	if (op1->opcode != op2->opcode || op1->d.func.fn_addr != op2->d.func.fn_addr || nargs != op2->d.func.nargs)
+		return false;
+	for (int argno = 0 ; argno < nargs ; argno++) {
+		struct ExprEvalStep *arg1 = op1 - nargs + argno;
+		struct ExprEvalStep *arg2 = op2 - nargs + argno;
+
+		if (arg1->opcode != arg2->opcode)
+			return false;
+		if (arg1->opcode == EEOP_CONST) {
+			Oid argtype = get_fn_expr_argtype(op1->d.func.finfo, argno);
+			int16 typlen;
+			bool typbyval;
+
+			if (arg1->d.constval.isnull != arg2->d.constval.isnull)
+				return false;
+			if (arg1->d.constval.isnull)
+				continue;
+			if (argtype != get_fn_expr_argtype(op2->d.func.finfo, argno))
+				return false;
+			get_typlenbyval(argtype, &typlen, &typbyval);
+			if (!datumIsEqual(arg1->d.constval.value, arg2->d.constval.value, typbyval, typlen))
+				return false;
+		} else if (arg1->d.var.attnum != arg2->d.var.attnum || arg1->d.var.vartype != arg2->d.var.vartype) {
+			return false;
+		}
+	}
+	return op1->d.func.finfo->fn_oid == op2->d.func.finfo->fn_oid &&
+		op1->d.func.fcinfo_data->fncollation == op2->d.func.fcinfo_data->fncollation;
+}
+
+/*
+ * The step holding the result of the call first, when the last step writing
+ * where the call put it is last_write, -1 if that result is lost.
+ */
+static int
+common_call_source(ExprState *state, int first, int last_write)
+{
+	struct ExprEvalStep *op = &state->steps[first];
+
+	if (last_write == first)
+		return first;
+	// A projected result is still in the result slot
+	if (op->resvalue == &state->resvalue &&
+		(state->steps[first + 1].opcode == EEOP_ASSIGN_TMP || state->steps[first + 1].opcode == EEOP_ASSIGN_TMP_MAKE_RO))
+		return first + 1;
+	return -1;
+}
+
+/*
+ * Whether the result of the call first, held by the step source, can be given
+ * to other calls. A function can modify a read/write expanded object it gets
+ * as argument, like array_append does, so a varlena result is only shared once
+ * made read-only in the result slot.
+ */
+static bool
+common_call_shareable(ExprState *state, int first, int source)
+{
+	FmgrInfo *finfo = state->steps[first].d.func.finfo;
+	Oid rettype = InvalidOid;
+
+	if (state->steps[source].opcode == EEOP_ASSIGN_TMP_MAKE_RO)
+		return true;
+	if (finfo->fn_expr)
+		rettype = get_fn_expr_rettype(finfo);
+	if (!OidIsValid(rettype))
+		rettype = get_func_rettype(finfo->fn_oid);
+	// The length of a polymorphic type is not the one of the result
+	if (!OidIsValid(rettype) || IsPolymorphicType(rettype))
+		return false;
+	return get_typlen(rettype) != -1;
+}
+
+static CommonCallWriter *
+common_call_writer(Datum *resvalue, int mask, bool insert)
+{
+	uint32 slot = hash_word((uint64) (uintptr_t) resvalue) & mask;
+
+	while (arena.call_writers[slot].resvalue != resvalue) {
+		if (arena.call_writers[slot].resvalue == NULL) {
+			if (!insert)
+				return NULL;
+			arena.call_writers[slot].resvalue = resvalue;
 			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return &arena.call_writers[slot];
+}
+
+/*
+ * Fill common with, for the first step of every call that can reuse an
+ * earlier result, the step holding that result, and -1 for the other steps.
+ *
+ * The earlier call must run on every path reaching the later one, and nothing
+ * in between may overwrite its result. The steps are scanned once, keeping the
+ * calls seen so far in a hash table on their function and arguments, and on a
+ * stack in the order of the steps. Jumps only go forward: a jump landing on a
+ * step after a call, from a step before it, skips the call, so every call above
+ * the source of the jump on the stack is dropped for good.
+ */
+static void
+find_common_calls(ExprState *state, int *common)
+{
+	int calls = 0;
+	int slots;
+	int jump_count = 0;
+	int depth = 0;
+	CommonCallStep *scan;
+
+	for (int opno = 0 ; opno < state->steps_len ; opno++) {
+		common[opno] = -1;
+		if (state->steps[opno].opcode == EEOP_FUNCEXPR || state->steps[opno].opcode == EEOP_FUNCEXPR_STRICT)
+			calls++;
+	}
+	if (calls < 2)
+		return;
+
+	slots = pg_nextpower2_32(calls * 2);
+	arena_reserve((void **) &arena.call_steps, &arena.call_steps_capacity, state->steps_len, sizeof(CommonCallStep));
+	arena_reserve((void **) &arena.call_keys, &arena.call_keys_capacity, slots, sizeof(CommonCallKey));
+	arena_reserve((void **) &arena.call_writers, &arena.call_writers_capacity, slots, sizeof(CommonCallWriter));
+	memset(arena.call_keys, -1, sizeof(CommonCallKey) * slots);
+	memset(arena.call_writers, 0, sizeof(CommonCallWriter) * slots);
+	scan = arena.call_steps;
+	for (int opno = 0 ; opno < state->steps_len ; opno++)
+		scan[opno].min_jump_source = INT_MAX;
+
+	for (int opno = 0 ; opno < state->steps_len ; opno++) {
+		struct ExprEvalStep *op = &state->steps[opno];
+		int targets[2];
+		int target_count;
+		int start;
+		uint32 hash;
+		CommonCallWriter *writer;
+
+		if (scan[opno].min_jump_source != INT_MAX) {
+			jump_count++;
+			while (depth > 0 && scan[depth - 1].stack > scan[opno].min_jump_source) {
+				int dropped = scan[--depth].stack;
+				CommonCallKey *key = &arena.call_keys[scan[dropped].key_slot];
+
+				if (key->latest == dropped)
+					key->latest = scan[dropped].previous;
+			}
+		}
+		scan[opno].jump_count = jump_count;
+
+		start = leaf_call_start(state, opno);
+		// Nothing may jump into the arguments of the call, or the call itself
+		if (start >= 0 && scan[start].jump_count == jump_count && leaf_call_hash(state, opno, &hash)) {
+			uint32 slot = hash & (slots - 1);
+			CommonCallKey *key;
+
+			while (arena.call_keys[slot].key_step >= 0 &&
+				   (arena.call_keys[slot].hash != hash || !same_leaf_call(state, arena.call_keys[slot].key_step, opno)))
+				slot = (slot + 1) & (slots - 1);
+			key = &arena.call_keys[slot];
+			if (key->key_step < 0) {
+				key->hash = hash;
+				key->key_step = opno;
+			}
+			while (key->latest >= 0) {
+				int first = key->latest;
+				int source = common_call_source(state, first,
+												common_call_writer(state->steps[first].resvalue, slots - 1, false)->opno);
+
+				if (source >= 0) {
+					// Checked last, this needs the catalogs
+					if (!op->d.func.finfo->fn_retset && func_volatile(op->d.func.finfo->fn_oid) == PROVOLATILE_IMMUTABLE &&
+						common_call_shareable(state, first, source))
+						common[start] = source;
+					break;
+				}
+				// Lost for the later calls too
+				key->latest = scan[first].previous;
+			}
+			if (common[start] < 0) {
+				scan[opno].previous = key->latest;
+				scan[opno].key_slot = slot;
+				key->latest = opno;
+				scan[depth++].stack = opno;
+				common_call_writer(op->resvalue, slots - 1, true);
+			}
+		}
+
+		// Only the results of the calls seen so far are followed
+		writer = common_call_writer(op->resvalue, slots - 1, false);
+		if (writer)
+			writer->opno = opno;
+		target_count = step_jump_targets(op, targets);
+		for (int t = 0 ; t < target_count ; t++) {
+			if (targets[t] > opno && targets[t] < state->steps_len && scan[targets[t]].min_jump_source == INT_MAX)
+				scan[targets[t]].min_jump_source = opno;
+		}
+	}
+}
+
+/*
+ * Last step replaced by the copy of a common call starting at opno.
+ */
+static int
+common_call_end(ExprState *state, int opno)
+{
+	while (state->steps[opno].opcode != EEOP_FUNCEXPR && state->steps[opno].opcode != EEOP_FUNCEXPR_STRICT)
+		opno++;
+	return opno;
+}
+
+/*
+ * Address of a target that does not depend on the expression: PostgreSQL
+ * functions and global variables called or read by the stencils.
+ */
+static intptr_t resolve_static_target(Target target)
+{
+	switch (target) {
+		case TARGET_MakeExpandedObjectReadOnlyInternal:
+			return (intptr_t) &MakeExpandedObjectReadOnlyInternal;
+		case TARGET_ExecEvalScalarArrayOp:
+			return (intptr_t) &ExecEvalScalarArrayOp;
+		case TARGET_ExecEvalSysVar:
+			return (intptr_t) &ExecEvalSysVar;
+		case TARGET_ExecEvalSQLValueFunction:
+			return (intptr_t) &ExecEvalSQLValueFunction;
+		case TARGET_ExecEvalParamExec:
+			return (intptr_t) &ExecEvalParamExec;
+		case TARGET_ExecEvalParamExtern:
+			return (intptr_t) &ExecEvalParamExtern;
+		case TARGET_slot_getsomeattrs_int:
+			return (intptr_t) &slot_getsomeattrs_int;
 		case TARGET_CurrentMemoryContext:
-			target = (intptr_t) &CurrentMemoryContext;
+			return (intptr_t) &CurrentMemoryContext;
+		case TARGET_ExecAggInitGroup:
+			return (intptr_t) &ExecAggInitGroup;
+#if PG_VERSION_NUM < 160000
+		case TARGET_ExecAggTransReparent:
+			return (intptr_t) &ExecAggTransReparent;
+#else
+		case TARGET_ExecAggCopyTransValue:
+			return (intptr_t) &ExecAggCopyTransValue;
+		case TARGET_ExecEvalPreOrderedDistinctSingle:
+			return (intptr_t) &ExecEvalPreOrderedDistinctSingle;
+		case TARGET_ExecEvalPreOrderedDistinctMulti:
+			return (intptr_t) &ExecEvalPreOrderedDistinctMulti;
+#endif
+		case TARGET_ExecEvalFieldSelect:
+			return (intptr_t) &ExecEvalFieldSelect;
+		case TARGET_pg_detoast_datum:
+			return (intptr_t) &pg_detoast_datum;
+		case TARGET_getKeyJsonValueFromContainer:
+			return (intptr_t) &getKeyJsonValueFromContainer;
+		case TARGET_JsonbValueToJsonb:
+			return (intptr_t) &JsonbValueToJsonb;
+		case TARGET_cstring_to_text_with_len:
+			return (intptr_t) &cstring_to_text_with_len;
+		case TARGET_datumCopy:
+			return (intptr_t) &datumCopy;
+		default:
+			elog(ERROR, "Unsupported target %i", target);
+	}
+	return 0;
+}
+
+static intptr_t get_patch_target(ExprState *state, CodeGen *codeGen, const EmitRecord *record, const struct Patch *patch)
+{
+	struct ExprEvalStep *op = &state->steps[record->opno];
+	struct ExprEvalStep *source;
+	int jump_targets[2];
+	int jump_target_count;
+	intptr_t target;
+	switch (patch->target) {
+		case TARGET_CONST_ISNULL:
+			target = op->d.constval.isnull;
+			break;
+		case TARGET_CONST_VALUE:
+			target = op->d.constval.value;
+			break;
+		case TARGET_RESULTNUM:
+			target = op->d.assign_tmp.resultnum;
+			break;
+		case TARGET_OP:
+			target = (intptr_t) op;
+			break;
+		case TARGET_NEXT_CALL:
+			target = (intptr_t) codeGen->code.as_void + record->offset + record->stencil->code_size;
+			break;
+		case TARGET_FORCE_NEXT_CALL:
+			target = (intptr_t) codeGen->code.as_void + codeGen->offsets[record->opno + 1];
+			break;
+		case TARGET_JUMP_DONE:
+		case TARGET_JUMP_NULL:
+		case TARGET_JUMP_DISTINCT:
+			// ROWCOMPARE_STEP is the only one with two targets, jumpnull then jumpdone
+			jump_target_count = step_jump_targets(op, jump_targets);
+			if (jump_target_count == 0)
+				elog(ERROR, "Unsupported jump target in opcode %s", opcodeNames[op->opcode]);
+			if (patch->target == TARGET_JUMP_DONE)
+				target = (intptr_t) codeGen->code.as_void + codeGen->offsets[jump_targets[jump_target_count - 1]];
+			else
+				target = (intptr_t) codeGen->code.as_void + codeGen->offsets[jump_targets[0]];
+			break;
+		case TARGET_RESULTSLOT_VALUES:
+			if (op->opcode == EEOP_ASSIGN_TMP || op->opcode == EEOP_ASSIGN_TMP_MAKE_RO)
+				target = (intptr_t) &(state->resultslot->tts_values[op->d.assign_tmp.resultnum]);
+			else if (op->opcode == EEOP_ASSIGN_SCAN_VAR || op->opcode == EEOP_ASSIGN_INNER_VAR || op->opcode == EEOP_ASSIGN_OUTER_VAR)
+				target = (intptr_t) &(state->resultslot->tts_values[op->d.assign_var.resultnum]);
+			else
+				elog(ERROR, "Unsupported target TARGET_RESULTSLOT_VALUES in opcode %s", opcodeNames[op->opcode]);
+			break;
+		case TARGET_RESULTSLOT_ISNULL:
+			if (op->opcode == EEOP_ASSIGN_TMP || op->opcode == EEOP_ASSIGN_TMP_MAKE_RO)
+				target = (intptr_t) &(state->resultslot->tts_isnull[op->d.assign_tmp.resultnum]);
+			else if (op->opcode == EEOP_ASSIGN_SCAN_VAR || op->opcode == EEOP_ASSIGN_INNER_VAR || op->opcode == EEOP_ASSIGN_OUTER_VAR)
+				target = (intptr_t) &(state->resultslot->tts_isnull[op->d.assign_var.resultnum]);
+			else
+				elog(ERROR, "Unsupported target TARGET_RESULTSLOT_ISNULL in opcode %s", opcodeNames[op->opcode]);
+			break;
+		case TARGET_PARAM_LIST:
+			target = (intptr_t) state->parent->state->es_param_list_info;
+			break;
+		case TARGET_PARAM_EXTERN_DATA:
+			target = (intptr_t) &(state->parent->state->es_param_list_info->params[op->d.param.paramid - 1]);
+			break;
+		case TARGET_FUNC_ARG:
+			target = (intptr_t) &(op->d.func.fcinfo_data->args[record->arg]);
+			break;
+		case TARGET_ASSIGN_COUNT:
+			target = record->arg;
+			break;
+		case TARGET_ASSIGN_TABLE:
+		case TARGET_SVF_CACHE:
+		case TARGET_PROFILE_COUNTER:
+		case TARGET_JSONB_KEY:
+		case TARGET_MEMO_CACHE:
+			target = record->data;
+			break;
+		case TARGET_FUNC_CALL:
+			target = (intptr_t) step_function(op);
+			break;
+		case TARGET_COMMON_VALUE:
+		case TARGET_COMMON_ISNULL:
+			// The result of the earlier call, or the slot it was assigned to
+			source = &state->steps[record->arg];
+			if (source->opcode == EEOP_ASSIGN_TMP || source->opcode == EEOP_ASSIGN_TMP_MAKE_RO) {
+				if (patch->target == TARGET_COMMON_VALUE)
+					target = (intptr_t) &(state->resultslot->tts_values[source->d.assign_tmp.resultnum]);
+				else
+					target = (intptr_t) &(state->resultslot->tts_isnull[source->d.assign_tmp.resultnum]);
+			} else if (patch->target == TARGET_COMMON_VALUE) {
+				target = (intptr_t) source->resvalue;
+			} else {
+				target = (intptr_t) source->resnull;
+			}
+			break;
+		case TARGET_CALL_RESVALUE:
+			target = (intptr_t) state->steps[common_call_end(state, record->opno)].resvalue;
+			break;
+		case TARGET_CALL_RESNULL:
+			target = (intptr_t) state->steps[common_call_end(state, record->opno)].resnull;
+			break;
+		case TARGET_FUNC_NARGS:
+			target = (intptr_t) op->d.func.nargs;
+			break;
+		case TARGET_ATTNUM:
+			if (op->opcode == EEOP_ASSIGN_SCAN_VAR || op->opcode == EEOP_ASSIGN_INNER_VAR || op->opcode == EEOP_ASSIGN_OUTER_VAR)
+				target = op->d.assign_var.attnum;
+			else if (op->opcode == EEOP_SCAN_VAR)
+				target = op->d.var.attnum;
+			else
+				elog(ERROR, "Unsupported target TARGET_ATTNUM in opcode %s", opcodeNames[op->opcode]);
 			break;
 		default:
-			elog(ERROR, "Unsupported target");
+			// PC-relative references to PostgreSQL functions can only be patched here
+			target = resolve_static_target(patch->target);
 			break;
 	};
 	return target + patch->addend;
 }
 
+/*
+ * REJUMP holes are the 12 bytes of a movabs $target, %rax ; jmp *%rax in the
+ * stencil, replaced by a jmp rel32 when the target is close enough, which is
+ * always the case within the code of an expression.
+ */
 static void apply_jump(CodeGen *codeGen, size_t offset, intptr_t target, const struct Patch *patch)
 {
 	// Note: this is amd64 only
-	// A LOT OF FUN !
-	// target is an address we need to jump to. we are playing with code with IP = offset+patch->offset
-	if (DEBUG_GEN)
-		elog(WARNING, "Asked to jump to %p, we are patching at %p", target, (intptr_t) codeGen->code.as_void + offset + patch->offset);
-	int64_t relative_jump = target - ((intptr_t) codeGen->code.as_void + offset + patch->offset);
-	// Note : one could build short jumps, but not sure it's worth the effort
-	// I assert we have no insane jump, but... meh, should implement a check
-	relative_jump -= 5;	// remove size of jump from offset
+	unsigned char *location = codeGen->code.as_char + offset + patch->offset;
+	int64_t relative_jump = target - ((intptr_t) location + 5);	// relative to the end of the jmp
 	int32_t near_jump = (int32_t) relative_jump;
-	codeGen->code.as_char[offset + patch->offset] = 0xE9;
-	memcpy(codeGen->code.as_void + offset + patch->offset + 1, &near_jump, 4);
+
+	if (DEBUG_GEN)
+		elog(WARNING, "Asked to jump to %p, we are patching at %p", (void *) target, location);
+	if (relative_jump == near_jump) {
+		location[0] = 0xE9;
+		memcpy(location + 1, &near_jump, 4);
+	} else {
+		// Out of reach, restore the absolute jump of the stencil
+		location[0] = 0x48;
+		location[1] = 0xB8;
+		memcpy(location + 2, &target, 8);
+		location[10] = 0xFF;
+		location[11] = 0xE0;
+	}
 }
 
 static void apply_patch_with_target (CodeGen *codeGen, size_t offset, intptr_t target, const struct Patch *patch)
@@ -532,173 +1734,2025 @@ static void apply_patch_with_target (CodeGen *codeGen, size_t offset, intptr_t t
 	}
 }
 
-static void apply_patch (ExprState *state, CodeGen *codeGen, size_t offset, size_t next_offset, struct ExprEvalStep *op, const struct Patch *patch)
-{
-	intptr_t target = get_patch_target(state, codeGen, next_offset, op, patch);
+/*
+ * Stencils ready to be copied. Their static holes were patched once, when
+ * loading the library, only the holes depending on the expression remain.
+ */
+typedef struct StencilProgram {
+	unsigned char *code;
+	const struct Patch *patches;
+	size_t patch_size;
+} StencilProgram;
 
-	apply_patch_with_target(codeGen, offset, target, patch);
+static StencilProgram programs[STENCIL_COUNT];
+
+static void
+prepare_stencil_programs(void)
+{
+	for (int i = 0 ; i < STENCIL_COUNT ; i++) {
+		const struct Stencil *stencil = all_stencils[i];
+		StencilProgram *program = &programs[stencil->id];
+		CodeGen codeGen;
+
+		memset(&codeGen, 0, sizeof(codeGen));
+		program->code = MemoryContextAlloc(TopMemoryContext, Max(stencil->code_size, 1));
+		memcpy(program->code, stencil->code, stencil->code_size);
+		codeGen.code.as_char = program->code;
+		codeGen.code_size = stencil->code_size;
+		for (int p = 0 ; p < stencil->static_patch_size ; p++) {
+			const struct Patch *patch = &stencil->patches[p];
+			apply_patch_with_target(&codeGen, 0, resolve_static_target(patch->target) + patch->addend, patch);
+		}
+		program->patches = stencil->patches + stencil->static_patch_size;
+		program->patch_size = stencil->patch_size - stencil->static_patch_size;
+	}
 }
 
-static size_t apply_stencil (struct Stencil *stencil, ExprState *state, CodeGen *codeGen, size_t offset, size_t next_offset, struct ExprEvalStep *op)
+/*
+ * Queue a copy of stencil for the step opno.
+ */
+static EmitRecord *
+emit_stencil(CodeGen *codeGen, const struct Stencil *stencil, int opno, int arg)
 {
-	memcpy(codeGen->code.as_void + offset, stencil->code, stencil->code_size);
-	for (int p = 0 ; p < stencil->patch_size ; p++) {
-		const struct Patch *patch = &stencil->patches[p];
-		apply_patch(state, codeGen, offset, next_offset, op, patch);
+	EmitRecord *record;
+
+	arena_reserve((void **) &arena.records, &arena.records_capacity, codeGen->record_count + 1, sizeof(EmitRecord));
+	codeGen->records = arena.records;
+	record = &codeGen->records[codeGen->record_count++];
+	record->stencil = stencil;
+	record->opno = opno;
+	record->arg = arg;
+	record->data = 0;
+	record->offset = codeGen->code_size;
+	codeGen->code_size += stencil->code_size;
+	if (TRAMPOLINE_SIZE) {
+		// Upper bound of the trampolines that will be needed
+		for (int p = 0 ; p < stencil->patch_size ; p++) {
+			if (stencil->patches[p].relkind == RELKIND_R_AARCH64_CALL26 || stencil->patches[p].relkind == RELKIND_R_AARCH64_JUMP26)
+				codeGen->required_trampolines++;
+		}
 	}
-	return stencil->code_size;
+	return record;
 }
 
-bool
-copyjit_compile_expr(ExprState *state)
+/*
+ * Allocate the hash table of the trampolines, at most half full.
+ */
+static void
+reserve_trampolines(CodeGen *codeGen)
 {
-	CopyJitContext *context = NULL;
-	instr_time	starttime;
-	instr_time	endtime;
-	bool canbuild = true;
-	int required_trampolines = 0;
-	size_t neededsize = 0;
-	size_t offset = 0;
+	uint32 slots = pg_nextpower2_32(codeGen->required_trampolines * 2);
 
-	CodeGen codeGen;
-	memset(&codeGen, 0, sizeof(codeGen));
+	codeGen->trampolines = palloc0(sizeof(Trampoline) * slots);
+	codeGen->trampoline_mask = slots - 1;
+}
 
-	int mprotect_res;
+/*
+ * Memory used by some stencils, allocated with the expression in the query
+ * context.
+ */
+static intptr_t
+record_data(ExprState *state, const EmitRecord *record)
+{
+	EState *estate = state->parent->state;
+	struct ExprEvalStep *op = &state->steps[record->opno];
 
-	PlanState  *parent = state->parent;
-	Assert(parent);
-	/* get or create JIT context */
-	if (parent->state->es_jit)
-		context = (CopyJitContext *) parent->state->es_jit;
-	else
-	{
-		context = copyjit_create_context(parent->state->es_jit_flags);
-		parent->state->es_jit = &context->base;
+	if (record->stencil == &extra_EEOP_SQLVALUEFUNCTION_CACHED) {
+		SQLValueCache *cache = MemoryContextAllocZero(estate->es_query_cxt, sizeof(SQLValueCache));
+		cache->cxt = estate->es_query_cxt;
+		return (intptr_t) cache;
 	}
-
-	INSTR_TIME_SET_CURRENT(starttime);
-
-	// This offset array is usefull later when jumps appear...
-	codeGen.offsets = malloc(sizeof(int) * state->steps_len);
-	for (int opno = 0; opno < state->steps_len; opno++)
+	if (record->stencil == &extra_EEOP_ASSIGN_SCAN_VAR_TABLE ||
+		record->stencil == &extra_EEOP_ASSIGN_INNER_VAR_TABLE ||
+		record->stencil == &extra_EEOP_ASSIGN_OUTER_VAR_TABLE) {
+		// The run length is the argument of the stencil
+		AssignVarPair *table = MemoryContextAlloc(estate->es_query_cxt, sizeof(AssignVarPair) * record->arg);
+		for (int r = 0 ; r < record->arg ; r++) {
+			table[r].attnum = op[r].d.assign_var.attnum;
+			table[r].resultnum = op[r].d.assign_var.resultnum - op->d.assign_var.resultnum;
+		}
+		return (intptr_t) table;
+	}
+	if (record->stencil == &extra_EEOP_FUNCEXPR_STRICT_jsonb_object_field ||
+		record->stencil == &extra_EEOP_FUNCEXPR_STRICT_jsonb_object_field_text) {
+		// Detoasted here rather than on every evaluation
+		MemoryContext oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
+		JsonbConstKey *key = palloc(sizeof(JsonbConstKey));
+		text *value = DatumGetTextPP(op[-1].d.constval.value);
+
+		key->data = VARDATA_ANY(value);
+		key->len = VARSIZE_ANY_EXHDR(value);
+		MemoryContextSwitchTo(oldcontext);
+		return (intptr_t) key;
+	}
+	if (record->stencil == &extra_EEOP_FUNCEXPR_MEMOIZED) {
+		CopyJitContext *context = (CopyJitContext *) estate->es_jit;
+		MemoCache *cache = MemoryContextAllocZero(estate->es_query_cxt, sizeof(MemoCache));
+		FmgrInfo *flinfo = op->d.func.finfo;
+
+		cache->cxt = AllocSetContextCreate(estate->es_query_cxt, "copyjit memoized results", ALLOCSET_SMALL_SIZES);
+		get_typlenbyval(get_fn_expr_rettype(flinfo), &cache->resulttyplen, &cache->resultbyval);
+		for (int argno = 0 ; argno < op->d.func.nargs ; argno++) {
+			if (!get_typbyval(get_fn_expr_argtype(flinfo, argno)))
+				cache->varlena_args |= 1 << argno;
+		}
+		cache->next = context->memo_caches;
+		context->memo_caches = cache;
+		return (intptr_t) cache;
+	}
+	return 0;
+}
+
+/*
+ * Does this SQLValueFunction return the same value for the whole statement?
+ * The current date and time are the ones of the start of the transaction,
+ * while the current user, schema or local time follow the role, search_path
+ * and TimeZone, which can change between two fetches of a cursor.
+ */
+static bool
+sql_value_is_stable(struct ExprEvalStep *op)
+{
+	switch (op->d.sqlvaluefunction.svf->op) {
+		case SVFOP_CURRENT_DATE:
+		case SVFOP_CURRENT_TIME:
+		case SVFOP_CURRENT_TIME_N:
+		case SVFOP_CURRENT_TIMESTAMP:
+		case SVFOP_CURRENT_TIMESTAMP_N:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Is the stencil of this opcode just a call to the function used by the
+ * interpreter? Compiling these only saves the dispatch.
+ */
+static bool
+opcode_calls_out(ExprEvalOp opcode)
+{
+	switch (opcode) {
+		case EEOP_INNER_SYSVAR:
+		case EEOP_OUTER_SYSVAR:
+		case EEOP_SCAN_SYSVAR:
+		case EEOP_PARAM_EXEC:
+		case EEOP_PARAM_EXTERN:
+		case EEOP_SQLVALUEFUNCTION:
+		case EEOP_SCALARARRAYOP:
+		case EEOP_FIELDSELECT:
+#if PG_VERSION_NUM >= 140000
+		case EEOP_SBSREF_SUBSCRIPTS:
+		case EEOP_SBSREF_OLD:
+		case EEOP_SBSREF_ASSIGN:
+		case EEOP_SBSREF_FETCH:
+#endif
+#if PG_VERSION_NUM >= 160000
+		case EEOP_AGG_PRESORTED_DISTINCT_SINGLE:
+		case EEOP_AGG_PRESORTED_DISTINCT_MULTI:
+#endif
+			return true;
+		default:
+			return false;
+	}
+}
+
+#if PG_VERSION_NUM >= 180000
+/*
+ * The stencil computing inline the hash of a HASHDATUM step, NULL when its
+ * hash function has none.
+ */
+static const struct Stencil *
+inline_hash_stencil(struct ExprEvalStep *op)
+{
+	static const struct Stencil *const uint32_stencils[] = {
+		&extra_EEOP_HASHDATUM_FIRST_uint32, &extra_EEOP_HASHDATUM_FIRST_STRICT_uint32,
+		&extra_EEOP_HASHDATUM_NEXT32_uint32, &extra_EEOP_HASHDATUM_NEXT32_STRICT_uint32
+	};
+	static const struct Stencil *const int8_stencils[] = {
+		&extra_EEOP_HASHDATUM_FIRST_int8, &extra_EEOP_HASHDATUM_FIRST_STRICT_int8,
+		&extra_EEOP_HASHDATUM_NEXT32_int8, &extra_EEOP_HASHDATUM_NEXT32_STRICT_int8
+	};
+	int variant;
+
+	switch (op->opcode) {
+		case EEOP_HASHDATUM_FIRST:
+			variant = 0;
+			break;
+		case EEOP_HASHDATUM_FIRST_STRICT:
+			variant = 1;
+			break;
+		case EEOP_HASHDATUM_NEXT32:
+			variant = 2;
+			break;
+		case EEOP_HASHDATUM_NEXT32_STRICT:
+			variant = 3;
+			break;
+		default:
+			return NULL;
+	}
+	if (op->d.hashdatum.fn_addr == &hashint4 || op->d.hashdatum.fn_addr == &hashoid)
+		return uint32_stencils[variant];
+	if (op->d.hashdatum.fn_addr == &hashint8)
+		return int8_stencils[variant];
+	return NULL;
+}
+#endif
+
+/*
+ * Choose the stencils implementing the step opno and queue them.
+ * Returns the number of steps consumed, 0 if the step is not supported.
+ */
+static int
+emit_step(ExprState *state, CodeGen *codeGen, int opno, const bool *jump_targets)
+{
+	struct ExprEvalStep *op = &state->steps[opno];
+	ExprEvalOp opcode = op->opcode;
+	EmitRecord *record;
+	int run_length;
+
+	if (DEBUG_GEN)
+		elog(WARNING, "Need to build an %s - %i opcode at %p", opcodeNames[opcode], opcode, op);
+
+	if (arena.common_calls && arena.common_calls[opno] >= 0) {
+		emit_stencil(codeGen, &extra_EEOP_FUNCEXPR_COMMON, opno, arena.common_calls[opno]);
+		codeGen->inlined_calls++;
+		return common_call_end(state, opno) - opno + 1;
+	}
+
+	run_length = assign_var_run_length(state, opno, jump_targets);
+	if (run_length >= 2) {
+		bool contiguous = assign_var_run_is_contiguous(state, opno, run_length);
+
+		record = emit_stencil(codeGen, assign_var_run_stencil(opcode, contiguous), opno, run_length);
+		record->data = record_data(state, record);
+		return run_length;
+	}
+
+#if PG_VERSION_NUM >= 180000
 	{
-		struct ExprEvalStep *op = &state->steps[opno];
-		ExprEvalOp opcode = op->opcode;
-		if (DEBUG_GEN)
-			elog(WARNING, "Need to build an %s - %i opcode at %p", opcodeNames[opcode], opcode, op);
+		const struct Stencil *hash_stencil = inline_hash_stencil(op);
 
-		codeGen.offsets[opno] = neededsize;
+		if (hash_stencil) {
+			emit_stencil(codeGen, hash_stencil, opno, 0);
+			codeGen->inlined_calls++;
+			return 1;
+		}
+	}
+#endif
 
-		if (opcode == EEOP_FUNCEXPR_STRICT && op->d.func.fn_addr == &int4eq) {
-			if (DEBUG_GEN)
-				elog(WARNING, "Found a call to int4eq, inlining the hard way!");
-			neededsize += extra_EEOP_FUNCEXPR_STRICT_int4eq.code_size;
-		} else if (opcode == EEOP_FUNCEXPR_STRICT && op->d.func.fn_addr == &int4lt) {
-			if (DEBUG_GEN)
-				elog(WARNING, "Found a call to int4lt, inlining the hard way!");
-			neededsize += extra_EEOP_FUNCEXPR_STRICT_int4lt.code_size;
-		} else if (opcode == EEOP_FUNCEXPR_STRICT) {
-			neededsize += stencils[EEOP_FUNCEXPR].code_size + op->d.func.nargs * extra_EEOP_FUNCEXPR_STRICT_CHECKER.code_size;
-		} else if (opcode == EEOP_CONST) {
-			if (DEBUG_GEN)
-				elog(WARNING, "Replacing EEOP_CONST with null/nonnull eeop_const");
-			if (op->d.constval.isnull)
-				neededsize += extra_EEOP_CONST_NULL.code_size;
-			else
-				neededsize += extra_EEOP_CONST_NOTNULL.code_size;
-		} else if (stencils[opcode].code_size == -1) {
-			elog(WARNING, "UNSUPPORTED OPCODE %s", opcodeNames[opcode]);
-			canbuild = false;
+#if PG_VERSION_NUM >= 140000
+	if (sbsref_array_fetch_fusable(state, opno) && !jump_targets[opno + 1]) {
+		emit_stencil(codeGen, &extra_EEOP_SBSREF_ARRAY_FETCH, opno, 0);
+		codeGen->inlined_calls++;
+		return 2;
+	}
+#endif
+
+	{
+		const struct Stencil *jsonb_stencil = jump_targets[opno] ? NULL : jsonb_const_key_stencil(state, opno);
+
+		if (jsonb_stencil) {
+			record = emit_stencil(codeGen, jsonb_stencil, opno, 0);
+			record->data = record_data(state, record);
+			codeGen->inlined_calls++;
+			return 1;
+		}
+	}
+
+	if (opcode == EEOP_FUNCEXPR_STRICT && op->d.func.fn_addr == &int4eq) {
+		if (DEBUG_GEN)
+			elog(WARNING, "Found a call to int4eq, inlining the hard way!");
+		emit_stencil(codeGen, &extra_EEOP_FUNCEXPR_STRICT_int4eq, opno, 0);
+		codeGen->inlined_calls++;
+	} else if (opcode == EEOP_FUNCEXPR_STRICT && op->d.func.fn_addr == &int4lt) {
+		if (DEBUG_GEN)
+			elog(WARNING, "Found a call to int4lt, inlining the hard way!");
+		emit_stencil(codeGen, &extra_EEOP_FUNCEXPR_STRICT_int4lt, opno, 0);
+		codeGen->inlined_calls++;
+	} else if (opcode == EEOP_FUNCEXPR_STRICT) {
+		// Prepend {op->d.func.nargs} extra_EEOP_FUNCEXPR_STRICT_CHECKER stencils before falling back on a FUNCEXPR
+		for (int narg = 0 ; narg < op->d.func.nargs ; narg++) {
+			if (codeGen->profile) {
+				record = emit_stencil(codeGen, &extra_EEOP_FUNCEXPR_STRICT_CHECKER_PROFILED, opno, narg);
+				record->data = (intptr_t) &codeGen->profile->branches[opno];
+			} else {
+				emit_stencil(codeGen, &extra_EEOP_FUNCEXPR_STRICT_CHECKER, opno, narg);
+			}
+		}
+		if (function_is_memoizable(op)) {
+			record = emit_stencil(codeGen, &extra_EEOP_FUNCEXPR_MEMOIZED, opno, 0);
+			record->data = record_data(state, record);
 		} else {
-			neededsize += stencils[opcode].code_size;
-			if (TRAMPOLINE_SIZE) {
-				// Check for patches that require trampolines to be built
-				for (int p = 0 ; p < stencils[opcode].patch_size ; p++) {
-					if (stencils[opcode].patches[p].relkind == RELKIND_R_AARCH64_CALL26) {
-						required_trampolines++;
-					}
-				}
+			emit_stencil(codeGen, &stencils[EEOP_FUNCEXPR], opno, 0);
+		}
+	} else if (opcode == EEOP_FUNCEXPR && function_is_memoizable(op)) {
+		record = emit_stencil(codeGen, &extra_EEOP_FUNCEXPR_MEMOIZED, opno, 0);
+		record->data = record_data(state, record);
+	} else if (opcode == EEOP_CONST) {
+		if (DEBUG_GEN)
+			elog(WARNING, "Replacing EEOP_CONST with null/nonnull eeop_const");
+		if (op->d.constval.isnull)
+			emit_stencil(codeGen, &extra_EEOP_CONST_NULL, opno, 0);
+		else
+			emit_stencil(codeGen, &extra_EEOP_CONST_NOTNULL, opno, 0);
+	} else if (opcode == EEOP_PARAM_EXTERN && param_extern_is_static(state, op)) {
+		emit_stencil(codeGen, &extra_EEOP_PARAM_EXTERN_DIRECT, opno, 0);
+	} else if (opcode == EEOP_SQLVALUEFUNCTION && sql_value_is_stable(op)) {
+		// The result is stable within the statement, cache it next to the expression
+		record = emit_stencil(codeGen, &extra_EEOP_SQLVALUEFUNCTION_CACHED, opno, 0);
+		record->data = record_data(state, record);
+	} else if (codeGen->profile && (opcode == EEOP_QUAL || opcode == EEOP_JUMP_IF_NOT_TRUE)) {
+		record = emit_stencil(codeGen, opcode == EEOP_QUAL ? &extra_EEOP_QUAL_PROFILED : &extra_EEOP_JUMP_IF_NOT_TRUE_PROFILED, opno, 0);
+		record->data = (intptr_t) &codeGen->profile->branches[opno];
+	} else if (stencils[opcode].code == NULL) {
+		elog(DEBUG1, "copyjit: unsupported opcode %s", opcodeNames[opcode]);
+		codeGen->unsupported_opcode = opcode;
+		return 0;
+	} else {
+		emit_stencil(codeGen, &stencils[opcode], opno, 0);
+		if (opcode_calls_out(opcode))
+			codeGen->callout_steps++;
+	}
+	return 1;
+}
+
+/*
+ * Select the stencils of all the steps, computing their offsets. Returns false
+ * if an opcode is not supported.
+ */
+static bool
+emit_steps(ExprState *state, CodeGen *codeGen)
+{
+	int consumed;
+
+	arena_reserve((void **) &arena.jump_targets, &arena.jump_targets_capacity, state->steps_len, sizeof(bool));
+	memset(arena.jump_targets, 0, sizeof(bool) * state->steps_len);
+	arena_reserve((void **) &arena.common_calls, &arena.common_calls_capacity, state->steps_len, sizeof(int));
+	// Reordered steps do not run in the order the common calls were checked for
+	if (recompile_order)
+		memset(arena.common_calls, -1, sizeof(int) * state->steps_len);
+	else
+		find_common_calls(state, arena.common_calls);
+
+	// Steps emitted out of order can jump backward in the code, all the
+	// targets must be known beforehand
+	if (recompile_order) {
+		for (int opno = 0 ; opno < state->steps_len ; opno++) {
+			int targets[2];
+			int target_count = step_jump_targets(&state->steps[opno], targets);
+			for (int t = 0 ; t < target_count ; t++)
+				arena.jump_targets[targets[t]] = true;
+		}
+		// The steps moved out of line can not be merged with their neighbours
+		for (int position = 0 ; position < recompile_order_len ; position++) {
+			if (recompile_order[position] < 0)
+				arena.jump_targets[-recompile_order[position]] = true;
+		}
+	}
+
+	// Single pass over the steps. Jumps only go forward, so when reaching a
+	// step all the jumps to it are known, and jump destinations are resolved
+	// once all the offsets are known.
+	for (int position = 0 ; position < (recompile_order ? recompile_order_len : state->steps_len) ; position += consumed)
+	{
+		int opno = recompile_order ? recompile_order[position] : position;
+
+		if (opno < 0) {
+			// FORCE_NEXT_CALL goes to the step following the one of the record
+			emit_stencil(codeGen, &extra_JUMP_NEXT_STEP, -opno - 1, 0);
+			consumed = 1;
+			continue;
+		}
+		codeGen->offsets[opno] = codeGen->code_size;
+		if (codeGen->profile) {
+			EmitRecord *record = emit_stencil(codeGen, &extra_PROFILE_STEP, opno, 0);
+			record->data = (intptr_t) &codeGen->profile->counts[opno];
+		}
+		consumed = emit_step(state, codeGen, opno, arena.jump_targets);
+		if (consumed == 0)
+			return false;
+		if (codeGen->code_size > MAX_EXPRESSION_CODE_SIZE) {
+			elog(DEBUG1, "copyjit: not compiling, more than %i bytes of code", MAX_EXPRESSION_CODE_SIZE);
+			return false;
+		}
+		for (int s = opno ; s < opno + consumed ; s++) {
+			int targets[2];
+			int target_count = step_jump_targets(&state->steps[s], targets);
+			for (int t = 0 ; t < target_count ; t++)
+				arena.jump_targets[targets[t]] = true;
+			// Nothing can jump inside merged steps, the following ones start after them
+			if (s > opno) {
+				codeGen->offsets[s] = codeGen->code_size;
+				if (codeGen->profile)
+					codeGen->profile->opcodes[s] = -1;
 			}
 		}
 	}
+	return true;
+}
 
-	// All opcodes are accounted for, we can proceed
-	if (canbuild) {
-		// Initialize the various codeGen fields
-		codeGen.code_size = neededsize;
-		// We will need required_trampolines * TRAMPOLINE_SIZE of memory, appended at the end of the code
-		codeGen.code.as_void = mmap(0, neededsize + required_trampolines * TRAMPOLINE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-		if (TRAMPOLINE_SIZE) {
-			codeGen.trampoline_count = 0;
-			codeGen.trampoline_targets = malloc(sizeof(void*) * required_trampolines);
-			memset(codeGen.trampoline_targets, 0, sizeof(void*) * required_trampolines);
-		}
-		context->code = codeGen.code.as_void;
-		context->code_size = neededsize + required_trampolines * TRAMPOLINE_SIZE;
-
-		for (int opno = 0 ; opno < state->steps_len ; opno++)
-		{
-			struct ExprEvalStep *op = &state->steps[opno];
-			ExprEvalOp opcode = ExecEvalStepOp(state, op);
-			size_t next_offset = codeGen.offsets[opno+1];
-			if (DEBUG_GEN)
-				elog(WARNING, "Adding stencil for %s, op address is %p", opcodeNames[opcode], op);
-
-			if (opcode == EEOP_FUNCEXPR_STRICT && op->d.func.fn_addr == &int4eq) {
-				offset += apply_stencil(&extra_EEOP_FUNCEXPR_STRICT_int4eq, state, &codeGen, offset, next_offset, op);
-			} else if (opcode == EEOP_FUNCEXPR_STRICT && op->d.func.fn_addr == &int4lt) {
-				offset += apply_stencil(&extra_EEOP_FUNCEXPR_STRICT_int4lt, state, &codeGen, offset, next_offset, op);
-			} else if (opcode == EEOP_FUNCEXPR_STRICT) {
-				// Prepend {op->d.func.nargs} extra_EEOP_FUNCEXPR_STRICT_CHECKER stencils before falling back on a FUNCEXPR
-				for (int narg = 0 ; narg < op->d.func.nargs ; narg++) {
-					memcpy(codeGen.code.as_void + offset, extra_EEOP_FUNCEXPR_STRICT_CHECKER.code, extra_EEOP_FUNCEXPR_STRICT_CHECKER.code_size);
-					for (int p = 0 ; p < extra_EEOP_FUNCEXPR_STRICT_CHECKER.patch_size ; p++) {
-						const struct Patch *patch = &extra_EEOP_FUNCEXPR_STRICT_CHECKER.patches[p];
-						if (patch->target == TARGET_FUNC_ARG) {
-							NullableDatum *func_arg = &(op->d.func.fcinfo_data->args[narg]);
-							apply_patch_with_target(&codeGen, offset, (intptr_t) func_arg, patch);
-						} else {
-							apply_patch(state, &codeGen, offset, next_offset, op, patch);
-						}
-					}
-					offset += extra_EEOP_FUNCEXPR_STRICT_CHECKER.code_size;
-				}
-				// Now we can land back on normal func call
-				offset += apply_stencil(&stencils[EEOP_FUNCEXPR], state, &codeGen, offset, next_offset, op);
-			} else if (opcode == EEOP_CONST) {
-				if (DEBUG_GEN)
-					elog(WARNING, "Replacing EEOP_CONST with null/nonnull eeop_const");
-				if (op->d.constval.isnull)
-					offset += apply_stencil(&extra_EEOP_CONST_NULL, state, &codeGen, offset, next_offset, op);
-				else
-					offset += apply_stencil(&extra_EEOP_CONST_NOTNULL, state, &codeGen, offset, next_offset, op);
-			} else {
-				offset += apply_stencil(&stencils[opcode], state, &codeGen, offset, next_offset, op);
+/*
+ * Is compiling this expression worth it? The checks here are done before
+ * generating anything.
+ */
+static bool
+worth_compiling(ExprState *state)
+{
+	PlannedStmt *stmt = state->parent->state->es_plannedstmt;
+
+	if (state->steps_len < copyjit_min_steps) {
+		elog(DEBUG1, "copyjit: not compiling, only %i steps", state->steps_len);
+		return false;
+	}
+	if (copyjit_above_cost > 0 && stmt && stmt->planTree &&
+		stmt->planTree->total_cost < copyjit_above_cost) {
+		elog(DEBUG1, "copyjit: not compiling, query cost %f is below copyjit.above_cost", stmt->planTree->total_cost);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Once the code size is known, check it still is worth mapping it.
+ */
+static bool
+worth_emitting(ExprState *state, CodeGen *codeGen)
+{
+	int inlined_steps = state->steps_len - codeGen->callout_steps;
+	size_t size = mapped_size(codeGen->code_size + codeGen->required_trampolines * TRAMPOLINE_SIZE);
+
+	if (copyjit_max_code_bytes > 0 && codeGen->code_size > copyjit_max_code_bytes) {
+		elog(DEBUG1, "copyjit: not compiling, %i bytes of code above copyjit.max_code_bytes", codeGen->code_size);
+		return false;
+	}
+	if (copyjit_max_code_memory > 0 && code_memory + size > (size_t) copyjit_max_code_memory * 1024) {
+		elog(DEBUG1, "copyjit: not compiling, %zu bytes of code already mapped, copyjit.max_code_memory reached", code_memory);
+		return false;
+	}
+#if defined(__aarch64__) || defined(_M_ARM64)
+	// Every jump must reach the trampolines at the end of the code
+	if (codeGen->code_size + (size_t) codeGen->required_trampolines * TRAMPOLINE_SIZE >= ARM64_X26_RANGE * 4) {
+		elog(DEBUG1, "copyjit: not compiling, %i bytes of code are out of reach of the trampolines", codeGen->code_size);
+		return false;
+	}
+#endif
+	// A chain of calls to the interpreter functions would not be faster
+	if (inlined_steps <= codeGen->callout_steps) {
+		elog(DEBUG1, "copyjit: not compiling, %i steps out of %i call the interpreter", codeGen->callout_steps, state->steps_len);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Copy the code of all the queued stencils in their final location, with their
+ * holes still to fill by patch_records.
+ */
+static void
+copy_records(CodeGen *codeGen)
+{
+	for (int r = 0 ; r < codeGen->record_count ; r++) {
+		const EmitRecord *record = &codeGen->records[r];
+
+		memcpy(codeGen->code.as_char + record->offset, programs[record->stencil->id].code, record->stencil->code_size);
+	}
+}
+
+/*
+ * Fill the holes of all the copied stencils with the targets of their step,
+ * in the code copied by copy_records or from a template.
+ */
+static void
+patch_records(ExprState *state, CodeGen *codeGen)
+{
+	for (int r = 0 ; r < codeGen->record_count ; r++) {
+		const EmitRecord *record = &codeGen->records[r];
+		const StencilProgram *program = &programs[record->stencil->id];
+
+		if (DEBUG_GEN)
+			elog(WARNING, "Patching stencil for %s at offset %i", opcodeNames[state->steps[record->opno].opcode], record->offset);
+		for (int p = 0 ; p < program->patch_size ; p++) {
+			const struct Patch *patch = &program->patches[p];
+			apply_patch_with_target(codeGen, record->offset, get_patch_target(state, codeGen, record, patch), patch);
+		}
+	}
+}
+
+/*
+ * Templates shared with parallel workers
+ *
+ * Workers build the same expressions as their leader, so instead of selecting
+ * the stencils again they look for a template the leader left with the records
+ * and the offsets. The worker copies the stencils of these records and patches
+ * the holes depending on its expression. Templates hold no address, so they
+ * can also be kept in a file from one server start to the next.
+ *
+ * A template applies to an expression having the same shape: everything
+ * emit_step looks at to select the stencils must be part of StepShape.
+ */
+typedef struct StepShape
+{
+	int opcode;
+	int jumps[2];
+	int variant;	// SHAPE_* flags of the specialized stencils chosen beyond the opcode
+	int common_call;	// step holding the result reused by this call, see find_common_calls
+	int64 detail[2];		// never an address, shapes are kept across restarts
+} StepShape;
+
+#define SHAPE_JSONB_CONST_KEY	0x01
+#define SHAPE_SBSREF_FUSED		0x02
+#define SHAPE_MEMOIZED			0x04
+
+typedef struct TemplateRecord
+{
+	int stencil_id;
+	int opno;
+	int arg;
+	int offset;
+} TemplateRecord;
+
+typedef struct CodeTemplate
+{
+	dsa_pointer next;
+	int steps_len;
+	int record_count;
+	int code_size;
+	int required_trampolines;
+	/* followed by the shape, the offsets and the records */
+} CodeTemplate;
+
+#define TEMPLATE_SHAPE(t)	((StepShape *) ((char *) (t) + MAXALIGN(sizeof(CodeTemplate))))
+#define TEMPLATE_OFFSETS(t)	((int *) (TEMPLATE_SHAPE(t) + (t)->steps_len))
+#define TEMPLATE_RECORDS(t)	((TemplateRecord *) (TEMPLATE_OFFSETS(t) + (t)->steps_len + 1))
+
+typedef struct TemplateDirectory
+{
+	dsa_pointer head;
+} TemplateDirectory;
+
+static StepShape *
+compute_shape(ExprState *state)
+{
+	StepShape *shape;
+
+	arena_reserve((void **) &arena.shape, &arena.shape_capacity, state->steps_len, sizeof(StepShape));
+	shape = arena.shape;
+	// Compared with memcmp, padding included
+	memset(shape, 0, sizeof(StepShape) * state->steps_len);
+	arena_reserve((void **) &arena.common_calls, &arena.common_calls_capacity, state->steps_len, sizeof(int));
+	find_common_calls(state, arena.common_calls);
+	for (int opno = 0 ; opno < state->steps_len ; opno++) {
+		struct ExprEvalStep *op = &state->steps[opno];
+		int targets[2];
+		int target_count = step_jump_targets(op, targets);
+
+		shape[opno].opcode = op->opcode;
+		shape[opno].jumps[0] = target_count > 0 ? targets[0] : -1;
+		shape[opno].jumps[1] = target_count > 1 ? targets[1] : -1;
+		shape[opno].common_call = arena.common_calls[opno];
+		if (jsonb_const_key_stencil(state, opno))
+			shape[opno].variant |= SHAPE_JSONB_CONST_KEY;
+#if PG_VERSION_NUM >= 140000
+		if (sbsref_array_fetch_fusable(state, opno))
+			shape[opno].variant |= SHAPE_SBSREF_FUSED;
+#endif
+		if (function_is_memoizable(op))
+			shape[opno].variant |= SHAPE_MEMOIZED;
+		switch (op->opcode) {
+			case EEOP_FUNCEXPR:
+			case EEOP_FUNCEXPR_STRICT:
+				// The inlined functions are chosen on fn_addr, given by the oid
+				shape[opno].detail[0] = op->d.func.finfo->fn_oid;
+				shape[opno].detail[1] = op->d.func.nargs;
+				break;
+			case EEOP_CONST:
+				shape[opno].detail[0] = op->d.constval.isnull;
+				break;
+			case EEOP_PARAM_EXTERN:
+				shape[opno].detail[0] = param_extern_is_static(state, op);
+				break;
+			case EEOP_SQLVALUEFUNCTION:
+				shape[opno].detail[0] = sql_value_is_stable(op);
+				break;
+			case EEOP_ASSIGN_INNER_VAR:
+			case EEOP_ASSIGN_OUTER_VAR:
+			case EEOP_ASSIGN_SCAN_VAR:
+				shape[opno].detail[0] = op->d.assign_var.attnum;
+				shape[opno].detail[1] = op->d.assign_var.resultnum;
+				break;
+#if PG_VERSION_NUM >= 180000
+			case EEOP_HASHDATUM_FIRST:
+			case EEOP_HASHDATUM_FIRST_STRICT:
+			case EEOP_HASHDATUM_NEXT32:
+			case EEOP_HASHDATUM_NEXT32_STRICT:
+				// The hash function decides whether the hash is computed inline
+				shape[opno].detail[0] = op->d.hashdatum.finfo->fn_oid;
+				break;
+#endif
+			default:
+				break;
+		}
+	}
+	return shape;
+}
+
+static void
+register_template_tranche(void)
+{
+	static bool registered = false;
+
+	if (!registered) {
+		LWLockRegisterTranche(shared->template_tranche_id, "copyjit_templates");
+		registered = true;
+	}
+}
+
+/*
+ * Find out whether templates are shared with the other processes of this
+ * parallel query, attaching to the area of the leader in a worker. A leader
+ * only creates its area when publishing its first template.
+ */
+static void
+setup_templates(CopyJitContext *context, EState *estate)
+{
+	BackendSlot *slot;
+	PGPROC *leader;
+
+	context->templates_state = TEMPLATES_NONE;
+	if (shared == NULL || estate->es_plannedstmt == NULL)
+		return;
+
+	// The plan of a worker comes from ExecSerializePlan, parallelModeNeeded is not set there
+	if (IsParallelWorker()) {
+		leader = MyProc->lockGroupLeader;
+		if (leader == NULL || leader == MyProc || GetNumberFromPGProc(leader) >= shared->slot_count)
+			return;
+		slot = &shared->slots[GetNumberFromPGProc(leader)];
+		if (slot->leader_pid != leader->pid)
+			return;
+		pg_read_barrier();
+		register_template_tranche();
+		// The leader waits for its workers before releasing its context, the directory still exists
+		context->templates = dsa_attach(slot->area);
+		dsa_pin_mapping(context->templates);
+		context->template_directory = slot->directory;
+		context->templates_state = TEMPLATES_WORKER;
+		return;
+	}
+
+	// Already publishing for an outer query of this backend
+	if (!estate->es_plannedstmt->parallelModeNeeded || MyProcNumber >= shared->slot_count || leading_context != NULL)
+		return;
+	leading_context = context;
+	context->templates_state = TEMPLATES_LEADER;
+}
+
+/*
+ * Publish the directory of the templates of this query in the slot of the
+ * backend, creating the area of the backend the first time.
+ */
+static void
+start_publishing(CopyJitContext *context)
+{
+	BackendSlot *slot = &shared->slots[MyProcNumber];
+	TemplateDirectory *directory;
+
+	if (leader_area == NULL) {
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		register_template_tranche();
+		leader_area = dsa_create(shared->template_tranche_id);
+		dsa_pin_mapping(leader_area);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	context->templates = leader_area;
+	context->template_directory = dsa_allocate0(context->templates, sizeof(TemplateDirectory));
+	directory = dsa_get_address(context->templates, context->template_directory);
+	directory->head = InvalidDsaPointer;
+
+	slot->area = dsa_get_handle(context->templates);
+	slot->directory = context->template_directory;
+	pg_write_barrier();
+	slot->leader_pid = MyProcPid;
+}
+
+/*
+ * Free the templates of a query once its workers are done, keeping the area
+ * for the next parallel query.
+ */
+static void
+retract_templates(CopyJitContext *context)
+{
+	TemplateDirectory *directory;
+	dsa_pointer template_pointer;
+
+	leading_context = NULL;
+	if (context->templates == NULL)
+		return;
+	shared->slots[MyProcNumber].leader_pid = 0;
+	pg_write_barrier();
+	directory = dsa_get_address(context->templates, context->template_directory);
+	template_pointer = directory->head;
+	while (DsaPointerIsValid(template_pointer)) {
+		dsa_pointer next = ((CodeTemplate *) dsa_get_address(context->templates, template_pointer))->next;
+
+		dsa_free(context->templates, template_pointer);
+		template_pointer = next;
+	}
+	dsa_free(context->templates, context->template_directory);
+	context->templates = NULL;
+}
+
+static Size
+template_size(int steps_len, int record_count)
+{
+	return MAXALIGN(sizeof(CodeTemplate))
+		+ sizeof(StepShape) * steps_len
+		+ sizeof(int) * (steps_len + 1)
+		+ sizeof(TemplateRecord) * record_count;
+}
+
+/*
+ * Save in template the stencils selected for an expression and where they
+ * are in its code.
+ */
+static void
+fill_template(CodeTemplate *template, ExprState *state, const StepShape *shape, const CodeGen *codeGen)
+{
+	TemplateRecord *records;
+
+	template->next = InvalidDsaPointer;
+	template->steps_len = state->steps_len;
+	template->record_count = codeGen->record_count;
+	template->code_size = codeGen->code_size;
+	template->required_trampolines = codeGen->required_trampolines;
+	memcpy(TEMPLATE_SHAPE(template), shape, sizeof(StepShape) * state->steps_len);
+	memcpy(TEMPLATE_OFFSETS(template), codeGen->offsets, sizeof(int) * (state->steps_len + 1));
+	records = TEMPLATE_RECORDS(template);
+	for (int r = 0 ; r < codeGen->record_count ; r++) {
+		records[r].stencil_id = codeGen->records[r].stencil->id;
+		records[r].opno = codeGen->records[r].opno;
+		records[r].arg = codeGen->records[r].arg;
+		records[r].offset = codeGen->records[r].offset;
+	}
+}
+
+static void
+publish_template(CopyJitContext *context, ExprState *state, const StepShape *shape, const CodeGen *codeGen)
+{
+	TemplateDirectory *directory;
+	dsa_pointer template_pointer;
+	CodeTemplate *template;
+
+	if (context->templates == NULL)
+		start_publishing(context);
+	directory = dsa_get_address(context->templates, context->template_directory);
+	template_pointer = dsa_allocate(context->templates, template_size(state->steps_len, codeGen->record_count));
+	template = dsa_get_address(context->templates, template_pointer);
+
+	fill_template(template, state, shape, codeGen);
+	// Workers may be reading the list already
+	template->next = directory->head;
+	pg_write_barrier();
+	directory->head = template_pointer;
+}
+
+static const CodeTemplate *
+find_template(CopyJitContext *context, ExprState *state, const StepShape *shape)
+{
+	TemplateDirectory *directory = dsa_get_address(context->templates, context->template_directory);
+	dsa_pointer template_pointer = directory->head;
+
+	pg_read_barrier();
+	while (DsaPointerIsValid(template_pointer)) {
+		CodeTemplate *template = dsa_get_address(context->templates, template_pointer);
+
+		if (template->steps_len == state->steps_len &&
+			memcmp(TEMPLATE_SHAPE(template), shape, sizeof(StepShape) * state->steps_len) == 0)
+			return template;
+		template_pointer = template->next;
+	}
+	return NULL;
+}
+
+/*
+ * Rebuild the records of an expression from a template instead of emitting
+ * its steps.
+ */
+static void
+load_template(ExprState *state, CodeGen *codeGen, const CodeTemplate *template)
+{
+	const TemplateRecord *records = TEMPLATE_RECORDS(template);
+
+	memcpy(codeGen->offsets, TEMPLATE_OFFSETS(template), sizeof(int) * (template->steps_len + 1));
+	arena_reserve((void **) &arena.records, &arena.records_capacity, template->record_count, sizeof(EmitRecord));
+	codeGen->records = arena.records;
+	codeGen->record_count = template->record_count;
+	codeGen->code_size = template->code_size;
+	codeGen->required_trampolines = template->required_trampolines;
+	for (int r = 0 ; r < template->record_count ; r++) {
+		EmitRecord *record = &codeGen->records[r];
+
+		record->stencil = all_stencils[records[r].stencil_id];
+		record->opno = records[r].opno;
+		record->arg = records[r].arg;
+		record->offset = records[r].offset;
+		record->data = record_data(state, record);
+	}
+}
+
+/*
+ * Persistent template store
+ *
+ * With copyjit.template_store, the templates built by a backend are written
+ * in this file when it exits, merged with the ones already there. The next
+ * backends map the file read-only and start with these templates instead of
+ * a cold cache. The code is copied again from the stencils of the records,
+ * with the static holes of the running server, so a file can be used by any
+ * server with the same build of the stencils, across restarts.
+ *
+ * The file is a TemplateStoreHeader followed by count entries, each a
+ * TemplateStoreEntry then the template, both MAXALIGNed.
+ */
+#define TEMPLATE_STORE_MAGIC		0x434A5453	// CJTS
+#define TEMPLATE_STORE_VERSION		2
+#define TEMPLATE_STORE_MAX_BYTES	(64 * 1024 * 1024)
+
+typedef struct TemplateStoreHeader
+{
+	uint32 magic;
+	uint32 version;
+	uint64 build_id;
+	uint64 count;
+} TemplateStoreHeader;
+
+typedef struct TemplateStoreEntry
+{
+	uint64 fingerprint;	// hash of the shape
+	uint64 size;		// of the template following the entry
+} TemplateStoreEntry;
+
+#define STORE_ENTRY_TEMPLATE(e)	((CodeTemplate *) ((char *) (e) + MAXALIGN(sizeof(TemplateStoreEntry))))
+#define STORE_ENTRY_SIZE(e)		(MAXALIGN(sizeof(TemplateStoreEntry)) + MAXALIGN((e)->size))
+
+typedef struct StoredTemplate
+{
+	uint64 fingerprint;
+	const CodeTemplate *template;
+} StoredTemplate;
+
+static struct {
+	bool loaded;
+	void *mapping;
+	size_t mapping_size;
+	StoredTemplate *index;	// sorted by fingerprint
+	int count;
+	List *pending;			// TemplateStoreEntry built by this backend, written at exit
+	size_t pending_bytes;
+} store;
+
+/*
+ * Identifies the stencils and the layout of the templates: a hash of the code
+ * and holes of every stencil.
+ */
+static uint64
+stencils_build_id(void)
+{
+	static uint64 build_id = 0;
+
+	if (build_id == 0) {
+		int shape_size = sizeof(StepShape);
+
+		build_id = hash_bytes_extended((const unsigned char *) &shape_size, sizeof(int), PG_VERSION_NUM);
+		for (int i = 0 ; i < STENCIL_COUNT ; i++) {
+			const struct Stencil *stencil = all_stencils[i];
+
+			build_id = hash_bytes_extended(stencil->code, stencil->code_size, build_id);
+			build_id = hash_bytes_extended((const unsigned char *) stencil->patches, sizeof(struct Patch) * stencil->patch_size, build_id);
+		}
+	}
+	return build_id;
+}
+
+static bool
+template_store_enabled(void)
+{
+	return copyjit_template_store != NULL && copyjit_template_store[0] != '\0';
+}
+
+static uint64
+shape_fingerprint(const StepShape *shape, int steps_len)
+{
+	return hash_bytes_extended((const unsigned char *) shape, sizeof(StepShape) * steps_len, steps_len);
+}
+
+static int
+stored_template_cmp(const void *a, const void *b)
+{
+	uint64 fa = ((const StoredTemplate *) a)->fingerprint;
+	uint64 fb = ((const StoredTemplate *) b)->fingerprint;
+
+	return fa < fb ? -1 : (fa > fb ? 1 : 0);
+}
+
+/*
+ * Is the argument of this record from the file within its expression? It is a
+ * step for a common call, the number of steps of an assignment run, and an
+ * argument of the call for a strict checker.
+ */
+static bool
+stored_record_arg_is_valid(const CodeTemplate *template, const TemplateRecord *record)
+{
+	const struct Stencil *stencil = all_stencils[record->stencil_id];
+
+	if (record->arg < 0)
+		return false;
+	if (stencil == &extra_EEOP_FUNCEXPR_COMMON)
+		return record->arg < template->steps_len;
+	if (stencil == &extra_EEOP_ASSIGN_SCAN_VAR_TABLE || stencil == &extra_EEOP_ASSIGN_INNER_VAR_TABLE ||
+		stencil == &extra_EEOP_ASSIGN_OUTER_VAR_TABLE || stencil == &extra_EEOP_ASSIGN_SCAN_VAR_BLOCK ||
+		stencil == &extra_EEOP_ASSIGN_INNER_VAR_BLOCK || stencil == &extra_EEOP_ASSIGN_OUTER_VAR_BLOCK)
+		return record->opno + record->arg <= template->steps_len;
+	if (stencil == &extra_EEOP_FUNCEXPR_STRICT_CHECKER || stencil == &extra_EEOP_FUNCEXPR_STRICT_CHECKER_PROFILED)
+		return record->arg < TEMPLATE_SHAPE(template)[record->opno].detail[1];
+	return true;
+}
+
+/*
+ * Is this template from the file consistent with its size, with all its
+ * stencils and jump targets within its code, and the arguments of its records
+ * within its expression?
+ */
+static bool
+stored_template_is_valid(const CodeTemplate *template, uint64 size)
+{
+	const int *offsets;
+	const TemplateRecord *records;
+
+	if (size < MAXALIGN(sizeof(CodeTemplate)) || template->steps_len <= 0 || template->record_count < 0 ||
+		template->code_size < 0 || template->required_trampolines < 0 ||
+		template_size(template->steps_len, template->record_count) != size)
+		return false;
+	// The offsets of the steps are jump targets
+	offsets = TEMPLATE_OFFSETS(template);
+	for (int opno = 0 ; opno <= template->steps_len ; opno++) {
+		if (offsets[opno] < (opno == 0 ? 0 : offsets[opno - 1]) || offsets[opno] > template->code_size)
+			return false;
+	}
+	records = TEMPLATE_RECORDS(template);
+	for (int r = 0 ; r < template->record_count ; r++) {
+		if (records[r].stencil_id < 0 || records[r].stencil_id >= STENCIL_COUNT ||
+			records[r].opno < 0 || records[r].opno >= template->steps_len || records[r].offset < 0 ||
+			records[r].offset + all_stencils[records[r].stencil_id]->code_size > template->code_size ||
+			!stored_record_arg_is_valid(template, &records[r]))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Map the store at path, NULL if it does not exist or was written by another
+ * build or server. The file holds code, it must belong to the server and not
+ * be writable by anyone else.
+ */
+static TemplateStoreHeader *
+map_template_store(const char *path, size_t *size)
+{
+	struct stat st;
+	TemplateStoreHeader *header;
+	int fd = open(path, O_RDONLY | PG_BINARY);
+
+	if (fd < 0) {
+		if (errno != ENOENT)
+			elog(LOG, "copyjit: could not open template store \"%s\": %m", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+		st.st_size < (off_t) sizeof(TemplateStoreHeader)) {
+		elog(LOG, "copyjit: ignoring template store \"%s\", not a file of the server", path);
+		close(fd);
+		return NULL;
+	}
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		elog(LOG, "copyjit: could not map template store \"%s\": %m", path);
+		return NULL;
+	}
+	if (header->magic != TEMPLATE_STORE_MAGIC || header->version != TEMPLATE_STORE_VERSION ||
+		header->build_id != stencils_build_id()) {
+		elog(DEBUG1, "copyjit: template store \"%s\" is from another build", path);
+		munmap(header, st.st_size);
+		return NULL;
+	}
+	*size = st.st_size;
+	return header;
+}
+
+/*
+ * The entry following the one at *offset in a mapped store, NULL at its end
+ * or if the rest of the file is not valid.
+ */
+static const TemplateStoreEntry *
+next_store_entry(const TemplateStoreHeader *header, size_t size, size_t *offset)
+{
+	const TemplateStoreEntry *entry;
+
+	if (*offset + MAXALIGN(sizeof(TemplateStoreEntry)) > size)
+		return NULL;
+	entry = (const TemplateStoreEntry *) ((const char *) header + *offset);
+	if (entry->size > size - *offset - MAXALIGN(sizeof(TemplateStoreEntry)) ||
+		!stored_template_is_valid(STORE_ENTRY_TEMPLATE(entry), entry->size))
+		return NULL;
+	*offset += STORE_ENTRY_SIZE(entry);
+	return entry;
+}
+
+static void
+load_template_store(void)
+{
+	TemplateStoreHeader *header;
+	size_t size;
+	size_t offset = MAXALIGN(sizeof(TemplateStoreHeader));
+	const TemplateStoreEntry *entry;
+
+	store.loaded = true;
+	if (!template_store_enabled())
+		return;
+	header = map_template_store(copyjit_template_store, &size);
+	if (header == NULL)
+		return;
+	store.mapping = header;
+	store.mapping_size = size;
+	store.index = MemoryContextAlloc(TopMemoryContext, sizeof(StoredTemplate) * Max(header->count, 1));
+	while (store.count < header->count && (entry = next_store_entry(header, size, &offset)) != NULL) {
+		store.index[store.count].fingerprint = entry->fingerprint;
+		store.index[store.count].template = STORE_ENTRY_TEMPLATE(entry);
+		store.count++;
+	}
+	qsort(store.index, store.count, sizeof(StoredTemplate), stored_template_cmp);
+	elog(DEBUG1, "copyjit: %d templates loaded from \"%s\"", store.count, copyjit_template_store);
+}
+
+/*
+ * The template with this shape built by this backend since it started, not
+ * written in the store yet.
+ */
+static const CodeTemplate *
+find_pending_template(ExprState *state, const StepShape *shape, uint64 fingerprint)
+{
+	ListCell *lc;
+
+	foreach(lc, store.pending) {
+		TemplateStoreEntry *entry = (TemplateStoreEntry *) lfirst(lc);
+		const CodeTemplate *template = STORE_ENTRY_TEMPLATE(entry);
+
+		if (entry->fingerprint == fingerprint && template->steps_len == state->steps_len &&
+			memcmp(TEMPLATE_SHAPE(template), shape, sizeof(StepShape) * state->steps_len) == 0)
+			return template;
+	}
+	return NULL;
+}
+
+static const CodeTemplate *
+find_stored_template(ExprState *state, const StepShape *shape, uint64 fingerprint)
+{
+	StoredTemplate key = {fingerprint, NULL};
+	StoredTemplate *found;
+
+	if (store.count == 0)
+		return find_pending_template(state, shape, fingerprint);
+	found = bsearch(&key, store.index, store.count, sizeof(StoredTemplate), stored_template_cmp);
+	if (found == NULL)
+		return find_pending_template(state, shape, fingerprint);
+	// bsearch may land on any of the templates sharing this fingerprint
+	while (found > store.index && found[-1].fingerprint == fingerprint)
+		found--;
+	for ( ; found < store.index + store.count && found->fingerprint == fingerprint ; found++) {
+		if (found->template->steps_len == state->steps_len &&
+			memcmp(TEMPLATE_SHAPE(found->template), shape, sizeof(StepShape) * state->steps_len) == 0)
+			return found->template;
+	}
+	return find_pending_template(state, shape, fingerprint);
+}
+
+/*
+ * Write the store again with the templates built by this backend, through a
+ * temporary file renamed over it. Backends exiting at the same time may lose
+ * some of the templates of each other, they will be built again.
+ */
+static void
+save_template_store(int code, Datum arg)
+{
+	char tmppath[MAXPGPATH];
+	TemplateStoreHeader header;
+	TemplateStoreHeader *existing;
+	size_t existing_size = 0;
+	size_t written;
+	int fd;
+	FILE *file;
+	ListCell *lc;
+
+	if (store.pending == NIL || !template_store_enabled())
+		return;
+	// Read again, other backends may have written it since this one started
+	existing = map_template_store(copyjit_template_store, &existing_size);
+
+	// The name can be guessed: never follow a link or reuse a file someone else created
+	snprintf(tmppath, MAXPGPATH, "%s.%d.tmp", copyjit_template_store, MyProcPid);
+	fd = open(tmppath, O_CREAT | O_EXCL | O_WRONLY | PG_BINARY, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		elog(LOG, "copyjit: could not create \"%s\": %m", tmppath);
+		goto done;
+	}
+	file = fdopen(fd, PG_BINARY_W);
+	if (file == NULL) {
+		elog(LOG, "copyjit: could not open \"%s\": %m", tmppath);
+		close(fd);
+		unlink(tmppath);
+		goto done;
+	}
+	memset(&header, 0, sizeof(header));
+	header.magic = TEMPLATE_STORE_MAGIC;
+	header.version = TEMPLATE_STORE_VERSION;
+	header.build_id = stencils_build_id();
+	written = MAXALIGN(sizeof(TemplateStoreHeader));
+	fseek(file, written, SEEK_SET);
+
+	if (existing) {
+		size_t offset = MAXALIGN(sizeof(TemplateStoreHeader));
+		const TemplateStoreEntry *entry;
+
+		while (header.count < existing->count && (entry = next_store_entry(existing, existing_size, &offset)) != NULL) {
+			if (written + STORE_ENTRY_SIZE(entry) > TEMPLATE_STORE_MAX_BYTES)
+				break;
+			fwrite(entry, STORE_ENTRY_SIZE(entry), 1, file);
+			written += STORE_ENTRY_SIZE(entry);
+			header.count++;
+		}
+	}
+	foreach(lc, store.pending) {
+		TemplateStoreEntry *entry = (TemplateStoreEntry *) lfirst(lc);
+		const CodeTemplate *template = STORE_ENTRY_TEMPLATE(entry);
+		bool duplicate = false;
+
+		if (written + STORE_ENTRY_SIZE(entry) > TEMPLATE_STORE_MAX_BYTES)
+			break;
+		if (existing) {
+			size_t offset = MAXALIGN(sizeof(TemplateStoreHeader));
+			const TemplateStoreEntry *other;
+
+			while (!duplicate && (other = next_store_entry(existing, existing_size, &offset)) != NULL) {
+				duplicate = other->fingerprint == entry->fingerprint && other->size == entry->size &&
+					memcmp(TEMPLATE_SHAPE(STORE_ENTRY_TEMPLATE(other)), TEMPLATE_SHAPE(template),
+						   sizeof(StepShape) * template->steps_len) == 0;
 			}
 		}
-		mprotect_res = mprotect(codeGen.code.as_void, neededsize, PROT_EXEC);
+		if (duplicate)
+			continue;
+		fwrite(entry, STORE_ENTRY_SIZE(entry), 1, file);
+		written += STORE_ENTRY_SIZE(entry);
+		header.count++;
+	}
+
+	fseek(file, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, file);
+	if (ferror(file) | (fclose(file) != 0)) {
+		elog(LOG, "copyjit: could not write \"%s\": %m", tmppath);
+		unlink(tmppath);
+	} else if (rename(tmppath, copyjit_template_store) != 0) {
+		elog(LOG, "copyjit: could not rename \"%s\" to \"%s\": %m", tmppath, copyjit_template_store);
+		unlink(tmppath);
+	}
+
+done:
+	if (existing)
+		munmap(existing, existing_size);
+}
+
+/*
+ * Keep the template of an expression compiled by this backend, to write it in
+ * the store when exiting.
+ */
+static void
+keep_template(ExprState *state, const StepShape *shape, const CodeGen *codeGen)
+{
+	Size size = template_size(state->steps_len, codeGen->record_count);
+	uint64 fingerprint = shape_fingerprint(shape, state->steps_len);
+	TemplateStoreEntry *entry;
+	MemoryContext oldcontext;
+
+	// The same expression compiled again, for another query or execution
+	if (find_pending_template(state, shape, fingerprint) != NULL)
+		return;
+	if (store.pending_bytes + MAXALIGN(sizeof(TemplateStoreEntry)) + MAXALIGN(size) > TEMPLATE_STORE_MAX_BYTES)
+		return;
+	if (store.pending == NIL)
+		on_proc_exit(save_template_store, (Datum) 0);
+	entry = MemoryContextAllocZero(TopMemoryContext, MAXALIGN(sizeof(TemplateStoreEntry)) + MAXALIGN(size));
+	entry->fingerprint = fingerprint;
+	entry->size = size;
+	fill_template(STORE_ENTRY_TEMPLATE(entry), state, shape, codeGen);
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	store.pending = lappend(store.pending, entry);
+	MemoryContextSwitchTo(oldcontext);
+	store.pending_bytes += STORE_ENTRY_SIZE(entry);
+}
+
+/*
+ * Symbols for perf
+ *
+ * Every stencil copied in the code gets a symbol named after its expression
+ * and step, like copyjit:expr12:EEOP_SCAN_VAR@+0x40. They are written either
+ * in /tmp/perf-<pid>.map, read by perf report directly, or in the jitdump
+ * format in /tmp/jit-<pid>.dump, including the code bytes so perf annotate
+ * works once merged with perf inject --jit (record with -k mono).
+ */
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+
+typedef struct JitDumpHeader
+{
+	uint32 magic;
+	uint32 version;
+	uint32 total_size;
+	uint32 elf_mach;
+	uint32 pad1;
+	uint32 pid;
+	uint64 timestamp;
+	uint64 flags;
+} JitDumpHeader;
+
+typedef struct JitDumpCodeLoad
+{
+	uint32 id;
+	uint32 total_size;
+	uint64 timestamp;
+	uint32 pid;
+	uint32 tid;
+	uint64 vma;
+	uint64 code_addr;
+	uint64 code_size;
+	uint64 code_index;
+	/* followed by the name and the code */
+} JitDumpCodeLoad;
+
+static FILE *perf_file = NULL;
+static int perf_file_kind = PERF_OUTPUT_OFF;
+static uint64 perf_code_index = 0;
+
+static uint64
+perf_timestamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool
+open_perf_file(void)
+{
+	char path[MAXPGPATH];
+
+	if (perf_file && perf_file_kind == copyjit_perf_output)
+		return true;
+	if (perf_file)
+		fclose(perf_file);
+	perf_file_kind = copyjit_perf_output;
+
+	if (copyjit_perf_output == PERF_OUTPUT_MAP) {
+		snprintf(path, MAXPGPATH, "/tmp/perf-%d.map", MyProcPid);
+		perf_file = fopen(path, "a");
+	} else {
+		JitDumpHeader header;
+
+		snprintf(path, MAXPGPATH, "/tmp/jit-%d.dump", MyProcPid);
+		perf_file = fopen(path, "w+");
+		if (perf_file) {
+			// perf finds the dump through this mapping of the file
+			if (mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ|PROT_EXEC, MAP_PRIVATE, fileno(perf_file), 0) == MAP_FAILED)
+				elog(WARNING, "could not map %s: %m", path);
+			memset(&header, 0, sizeof(header));
+			header.magic = JITDUMP_MAGIC;
+			header.version = JITDUMP_VERSION;
+			header.total_size = sizeof(header);
+#if defined(__x86_64__)
+			header.elf_mach = 62;	// EM_X86_64
+#elif defined(__aarch64__) || defined(_M_ARM64)
+			header.elf_mach = 183;	// EM_AARCH64
+#endif
+			header.pid = MyProcPid;
+			header.timestamp = perf_timestamp();
+			fwrite(&header, sizeof(header), 1, perf_file);
+		}
+	}
+	if (perf_file == NULL) {
+		elog(WARNING, "could not open %s: %m", path);
+		return false;
+	}
+	return true;
+}
+
+static void
+write_perf_symbol(void *start, size_t size, const char *name)
+{
+	if (size == 0)
+		return;
+	if (perf_file_kind == PERF_OUTPUT_MAP) {
+		fprintf(perf_file, "%lx %zx %s\n", (unsigned long) (uintptr_t) start, size, name);
+	} else {
+		JitDumpCodeLoad record;
+		size_t name_size = strlen(name) + 1;
+
+		record.id = JIT_CODE_LOAD;
+		record.total_size = sizeof(record) + name_size + size;
+		record.timestamp = perf_timestamp();
+		record.pid = MyProcPid;
+		record.tid = MyProcPid;
+		record.vma = (uintptr_t) start;
+		record.code_addr = (uintptr_t) start;
+		record.code_size = size;
+		record.code_index = perf_code_index++;
+		fwrite(&record, sizeof(record), 1, perf_file);
+		fwrite(name, name_size, 1, perf_file);
+		fwrite(start, size, 1, perf_file);
+	}
+}
+
+static void
+write_perf_symbols(ExprState *state, const CodeGen *codeGen, size_t total_size, int expression)
+{
+	char name[NAMEDATALEN * 2];
+
+	if (!open_perf_file())
+		return;
+	for (int r = 0 ; r < codeGen->record_count ; r++) {
+		const EmitRecord *record = &codeGen->records[r];
+		int end = r + 1 < codeGen->record_count ? codeGen->records[r + 1].offset : codeGen->code_size;
+
+		snprintf(name, sizeof(name), "copyjit:expr%d:%s@+0x%x", expression,
+				 opcodeNames[state->steps[record->opno].opcode], record->offset);
+		write_perf_symbol(codeGen->code.as_char + record->offset, end - record->offset, name);
+	}
+	snprintf(name, sizeof(name), "copyjit:expr%d:trampolines", expression);
+	write_perf_symbol(codeGen->code.as_char + codeGen->code_size, total_size - codeGen->code_size, name);
+	fflush(perf_file);
+}
+
+static uint64
+arena_bytes(void)
+{
+	return arena.offsets_capacity * sizeof(int)
+		+ arena.jump_targets_capacity * sizeof(bool)
+		+ arena.records_capacity * sizeof(EmitRecord)
+		+ arena.shape_capacity * sizeof(StepShape)
+		+ arena.common_calls_capacity * sizeof(int)
+		+ arena.call_steps_capacity * sizeof(CommonCallStep)
+		+ arena.call_keys_capacity * sizeof(CommonCallKey)
+		+ arena.call_writers_capacity * sizeof(CommonCallWriter);
+}
+
+/*
+ * Account for a compilation in the shared statistics.
+ */
+static void
+report_compile(const CodeGen *codeGen, bool compiled, uint64 duration_us, size_t code_bytes)
+{
+	BackendSlot *slot = my_backend_slot();
+	int bucket = 0;
+
+	if (compiled) {
+		pg_atomic_fetch_add_u64(&shared->compiles, 1);
+		pg_atomic_fetch_add_u64(&shared->bytes_emitted, code_bytes);
+	} else if (codeGen->unsupported_opcode >= 0) {
+		pg_atomic_fetch_add_u64(&shared->failed_compiles, 1);
+		pg_atomic_fetch_add_u64(&shared->unsupported[codeGen->unsupported_opcode], 1);
+	} else {
+		pg_atomic_fetch_add_u64(&shared->fallbacks, 1);
+	}
+
+	pg_atomic_fetch_add_u64(&shared->compile_time_us, duration_us);
+	while (duration_us > 0 && bucket < COMPILE_TIME_BUCKETS - 1) {
+		duration_us >>= 1;
+		bucket++;
+	}
+	pg_atomic_fetch_add_u64(&shared->compile_times[bucket], 1);
+
+	if (slot)
+		pg_atomic_write_u64(&slot->arena_bytes, arena_bytes());
+}
+
+/*
+ * Profile-guided recompilation
+ *
+ * With copyjit.pgo_evaluations, expressions are first compiled with the
+ * counters of the profiling mode. After that many evaluations they are
+ * compiled again without the counters, and the quals of an ExecQual
+ * expression are emitted in a new order, the most selective and cheapest
+ * first.
+ *
+ * Only quals made of leakproof functions are reordered: these can not throw
+ * errors or have side effects, so the order of evaluation can not be noticed.
+ */
+typedef struct QualBlock
+{
+	int first;		// first step of the qual
+	int last;		// its EEOP_QUAL step
+	double rank;
+} QualBlock;
+
+static bool
+step_is_reorderable(const struct ExprEvalStep *op)
+{
+	switch (op->opcode) {
+		case EEOP_INNER_VAR:
+		case EEOP_OUTER_VAR:
+		case EEOP_SCAN_VAR:
+		case EEOP_CONST:
+		case EEOP_PARAM_EXTERN:
+		case EEOP_BOOL_AND_STEP_FIRST:
+		case EEOP_BOOL_AND_STEP:
+		case EEOP_BOOL_AND_STEP_LAST:
+		case EEOP_BOOL_OR_STEP_FIRST:
+		case EEOP_BOOL_OR_STEP:
+		case EEOP_BOOL_OR_STEP_LAST:
+		case EEOP_BOOL_NOT_STEP:
+		case EEOP_NULLTEST_ISNULL:
+		case EEOP_NULLTEST_ISNOTNULL:
+		case EEOP_BOOLTEST_IS_TRUE:
+		case EEOP_BOOLTEST_IS_NOT_TRUE:
+		case EEOP_BOOLTEST_IS_FALSE:
+		case EEOP_BOOLTEST_IS_NOT_FALSE:
+		case EEOP_QUAL:
+			return true;
+		case EEOP_FUNCEXPR:
+		case EEOP_FUNCEXPR_STRICT:
+			return get_func_leakproof(op->d.func.finfo->fn_oid) &&
+				func_volatile(op->d.func.finfo->fn_oid) != PROVOLATILE_VOLATILE;
+		default:
+			return false;
+	}
+}
+
+static int
+compare_qual_blocks(const void *a, const void *b)
+{
+	const QualBlock *block_a = (const QualBlock *) a;
+	const QualBlock *block_b = (const QualBlock *) b;
+
+	if (block_a->rank != block_b->rank)
+		return block_a->rank > block_b->rank ? -1 : 1;
+	return block_a->first - block_b->first;
+}
+
+/*
+ * Order in which to emit the steps, or NULL to keep them in place. The quals
+ * are sorted by the rate of rows they rejected per step evaluated.
+ */
+static int *
+plan_qual_order(ExprState *state, const ExprProfile *profile)
+{
+	int done = state->steps_len - 1;
+	int first = 0;
+	int start;
+	int furthest = -1;
+	int block_count = 0;
+	QualBlock *blocks;
+	int *order;
+	int position = 0;
+
+	if (done < 0 || state->steps[done].opcode != EEOP_DONE_RETURN)
+		return NULL;
+	// The deforming steps stay first
+	while (first < done &&
+		   (state->steps[first].opcode == EEOP_INNER_FETCHSOME ||
+			state->steps[first].opcode == EEOP_OUTER_FETCHSOME ||
+			state->steps[first].opcode == EEOP_SCAN_FETCHSOME))
+		first++;
+
+	blocks = palloc(sizeof(QualBlock) * state->steps_len);
+	start = first;
+	for (int opno = first ; opno < done ; opno++) {
+		struct ExprEvalStep *op = &state->steps[opno];
+		int targets[2];
+		int target_count = step_jump_targets(op, targets);
+
+		if (!step_is_reorderable(op))
+			goto keep_order;
+		// Jumps must stay in the qual or leave the expression
+		for (int t = 0 ; t < target_count ; t++) {
+			if (targets[t] != done)
+				furthest = Max(furthest, targets[t]);
+		}
+		if (op->opcode == EEOP_QUAL) {
+			double evaluations = profile->counts[start];
+			double rejected = profile->branches[opno];
+
+			if (furthest > opno || op->d.qualexpr.jumpdone != done)
+				goto keep_order;
+			blocks[block_count].first = start;
+			blocks[block_count].last = opno;
+			blocks[block_count].rank = evaluations > 0 ? rejected / evaluations / (opno - start + 1) : 0;
+			block_count++;
+			start = opno + 1;
+			furthest = -1;
+		}
+	}
+	if (start != done || block_count < 2)
+		goto keep_order;
+
+	qsort(blocks, block_count, sizeof(QualBlock), compare_qual_blocks);
+	order = palloc(sizeof(int) * state->steps_len);
+	for (int opno = 0 ; opno < first ; opno++)
+		order[position++] = opno;
+	for (int b = 0 ; b < block_count ; b++) {
+		for (int opno = blocks[b].first ; opno <= blocks[b].last ; opno++)
+			order[position++] = opno;
+	}
+	order[position++] = done;
+	pfree(blocks);
+	return order;
+
+keep_order:
+	pfree(blocks);
+	return NULL;
+}
+
+static bool
+step_falls_through(const struct ExprEvalStep *op)
+{
+	switch (op->opcode) {
+		case EEOP_JUMP:
+		case EEOP_DONE_RETURN:
+#if PG_VERSION_NUM >= 180000
+		case EEOP_DONE_NO_RETURN:
+#endif
+			return false;
+		default:
+			return true;
+	}
+}
+
+/*
+ * Order in which to emit the steps, or NULL to keep them in place, with the
+ * number of its entries in order_len.
+ *
+ * When the quals are not reordered by plan_qual_order, the runs of steps never
+ * evaluated during the training, like the branch of a CASE never taken, are
+ * moved after the end of the expression, so the code evaluated stays together.
+ * A jump to the run replaces the fall through into it, and another one after
+ * the run goes back to the step following it. The counts of reordered quals
+ * do not tell which steps the new order evaluates, these are left in place.
+ */
+static int *
+plan_emission_order(ExprState *state, const ExprProfile *profile, int *order_len)
+{
+	int *order = plan_qual_order(state, profile);
+	bool *cold;
+	int *moved;
+	int length = 0;
+	int moved_len = 0;
+	uint64 count = 0;
+
+	*order_len = state->steps_len;
+	if (order || profile->counts[0] == 0)
+		return order;
+	// Merged steps are counted with the first one
+	cold = palloc(sizeof(bool) * state->steps_len);
+	for (int opno = 0 ; opno < state->steps_len ; opno++) {
+		if (profile->opcodes[opno] >= 0)
+			count = profile->counts[opno];
+		cold[opno] = count == 0;
+	}
+
+	// Each moved run adds at most two jumps
+	order = palloc(sizeof(int) * state->steps_len * 3);
+	moved = palloc(sizeof(int) * state->steps_len * 3);
+	for (int opno = 0 ; opno < state->steps_len ; ) {
+		int last = opno;
+
+		if (!cold[opno]) {
+			order[length++] = opno++;
+			continue;
+		}
+		// Step 0 is always evaluated, the run has a step before it
+		while (last + 1 < state->steps_len && cold[last + 1])
+			last++;
+		if (last + 1 == state->steps_len && step_falls_through(&state->steps[last])) {
+			// Not expected, the last step ends the expression
+			while (opno <= last)
+				order[length++] = opno++;
+			continue;
+		}
+		if (step_falls_through(&state->steps[opno - 1]))
+			order[length++] = ORDER_JUMP_TO(opno);
+		while (opno <= last)
+			moved[moved_len++] = opno++;
+		if (step_falls_through(&state->steps[last]))
+			moved[moved_len++] = ORDER_JUMP_TO(last + 1);
+	}
+	pfree(cold);
+	if (moved_len == 0) {
+		pfree(order);
+		pfree(moved);
+		return NULL;
+	}
+	memcpy(order + length, moved, sizeof(int) * moved_len);
+	*order_len = length + moved_len;
+	pfree(moved);
+	return order;
+}
+
+static void
+recompile_with_profile(ExprState *state)
+{
+	CompiledExpr *training = (CompiledExpr *) state->evalfunc_private;
+	MemoryContext oldcontext;
+	int *order;
+	int order_len;
+	bool compiled = false;
+
+	// We are called during evaluation, in a short-lived context
+	oldcontext = MemoryContextSwitchTo(state->parent->state->es_query_cxt);
+	order = plan_emission_order(state, training->profile, &order_len);
+	recompiling = true;
+	recompile_order = order;
+	recompile_order_len = order_len;
+	PG_TRY();
+	{
+		compiled = copyjit_compile_expr(state);
+	}
+	PG_FINALLY();
+	{
+		recompiling = false;
+		recompile_order = NULL;
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PG_END_TRY();
+
+	if (!compiled) {
+		// Keep the code with the counters, without counting anymore
+		state->evalfunc_private = training;
+		state->evalfunc = ExecRunCompiledExpr;
+	} else {
+		unmap_code((CopyJitContext *) state->parent->state->es_jit, training->code);
+	}
+	if (order)
+		pfree(order);
+}
+
+static Datum
+ExecRunCompiledExprTraining(ExprState *state, ExprContext *econtext, bool *isNull)
+{
+	CompiledExpr *compiled = (CompiledExpr *) state->evalfunc_private;
+
+	if (++compiled->calls >= compiled->threshold) {
+		recompile_with_profile(state);
+		return state->evalfunc(state, econtext, isNull);
+	}
+	return ((ExprStateEvalFunc) compiled->code) (state, econtext, isNull);
+}
+
+bool
+copyjit_compile_expr(ExprState *state)
+{
+	CopyJitContext *context = NULL;
+	instr_time	starttime;
+	instr_time	selectiontime;
+	instr_time	emissiontime;
+	instr_time	endtime;
+	instr_time	duration;
+	bool canbuild = true;
+	size_t total_size = 0;
+	CompiledExpr *compiled;
+	StepShape *shape = NULL;
+	const CodeTemplate *template = NULL;
+	int expression = ++expression_count;
+	bool training = false;
+
+	CodeGen codeGen;
+	memset(&codeGen, 0, sizeof(codeGen));
+	codeGen.unsupported_opcode = -1;
+
+	int mprotect_res;
+
+	PlanState  *parent = state->parent;
+	Assert(parent);
+
+	INSTR_TIME_SET_CURRENT(starttime);
+
+	/* get or create JIT context */
+	if (parent->state->es_jit)
+		context = (CopyJitContext *) parent->state->es_jit;
+	else
+	{
+		context = copyjit_create_context(parent->state->es_jit_flags);
+		// Only the leader reports, EXPLAIN shows the sum of the workers' instrumentation only
+		context->report_counters = copyjit_explain_counters && parent->state->es_instrument != 0 && !IsParallelWorker();
+		parent->state->es_jit = &context->base;
+	}
+
+	if (!worth_compiling(state)) {
+		context->counters.fallbacks++;
+		if (shared)
+			pg_atomic_fetch_add_u64(&shared->fallbacks, 1);
+		return false;
+	}
+
+	arena_reserve((void **) &arena.offsets, &arena.offsets_capacity, state->steps_len + 1, sizeof(int));
+	codeGen.offsets = arena.offsets;
+
+	if (context->templates_state == TEMPLATES_UNKNOWN)
+		setup_templates(context, parent->state);
+	// Profiling stencils are not part of the shape, the two can not be mixed
+	if (copyjit_profile) {
+		// Kept until the context is released, even after an error
+		codeGen.profile = create_profile(state, expression, TopMemoryContext);
+	} else if (copyjit_pgo_evaluations > 0 && !recompiling) {
+		codeGen.profile = create_profile(state, expression, parent->state->es_query_cxt);
+		training = true;
+	} else if ((context->templates_state != TEMPLATES_NONE || template_store_enabled()) && !recompiling) {
+		shape = compute_shape(state);
+	}
+	if (shape && context->templates_state == TEMPLATES_WORKER) {
+		template = find_template(context, state, shape);
+		pg_atomic_fetch_add_u64(template ? &shared->template_hits : &shared->template_misses, 1);
+	}
+	if (shape && template == NULL && template_store_enabled()) {
+		if (!store.loaded)
+			load_template_store();
+		template = find_stored_template(state, shape, shape_fingerprint(shape, state->steps_len));
+		if (shared)
+			pg_atomic_fetch_add_u64(template ? &shared->template_hits : &shared->template_misses, 1);
+	}
+
+	// Selecting the stencils is reported as inlining, it is where calls get replaced by code
+	INSTR_TIME_SET_CURRENT(selectiontime);
+	if (template) {
+		load_template(state, &codeGen, template);
+	} else {
+		canbuild = emit_steps(state, &codeGen);
+	}
+
+	// Templates passed the same checks in the leader, except the memory limit of this backend
+	if (canbuild)
+		canbuild = worth_emitting(state, &codeGen);
+
+	INSTR_TIME_SET_CURRENT(emissiontime);
+	if (canbuild) {
+		codeGen.offsets[state->steps_len] = codeGen.code_size;
+		// Trampolines are appended at the end of the code
+		total_size = codeGen.code_size + codeGen.required_trampolines * TRAMPOLINE_SIZE;
+		codeGen.code.as_void = map_code(context, total_size);
+		if (TRAMPOLINE_SIZE && codeGen.required_trampolines > 0)
+			reserve_trampolines(&codeGen);
+
+		copy_records(&codeGen);
+		if (template == NULL) {
+			if (shape && context->templates_state == TEMPLATES_LEADER)
+				publish_template(context, state, shape, &codeGen);
+			if (shape && template_store_enabled())
+				keep_template(state, shape, &codeGen);
+		}
+		patch_records(state, &codeGen);
+
+		mprotect_res = mprotect(codeGen.code.as_void, total_size, PROT_READ|PROT_EXEC);
 		if (DEBUG_GEN)
 			elog(WARNING, "Result of mprotect is %i", mprotect_res);
-		state->evalfunc_private = codeGen.code.as_void;
+		if (copyjit_perf_output != PERF_OUTPUT_OFF)
+			write_perf_symbols(state, &codeGen, total_size, expression);
+		compiled = MemoryContextAllocZero(parent->state->es_query_cxt, sizeof(CompiledExpr));
+		compiled->code = codeGen.code.as_void;
+		state->evalfunc_private = compiled;
 //		state->evalfunc = (ExprStateEvalFunc) codeGen.code.as_void; // We jump through ExecRunCompiledExpr so we can breakpoint, if needed...
-		state->evalfunc = ExecRunCompiledExpr;
+		if (training) {
+			compiled->profile = codeGen.profile;
+			compiled->threshold = copyjit_pgo_evaluations;
+			state->evalfunc = ExecRunCompiledExprTraining;
+		} else if (copyjit_tier_up_threshold > 0 && load_llvm_provider()) {
+			compiled->threshold = copyjit_tier_up_threshold;
+			state->evalfunc = ExecRunCompiledExprCounting;
+		}
+		else
+			state->evalfunc = ExecRunCompiledExpr;
 		if (DEBUG_GEN)
-			elog(WARNING, "Code generated is located at %p for %i bytes (with %i trampolines)", codeGen.code.as_void, codeGen.code_size, required_trampolines);
+			elog(WARNING, "Code generated is located at %p for %i bytes (with %i trampolines)", codeGen.code.as_void, codeGen.code_size, codeGen.trampoline_count);
+	}
+	if (codeGen.trampolines)
+		pfree(codeGen.trampolines);
+
+	if (codeGen.profile && !training) {
+		if (canbuild) {
+			codeGen.profile->next = context->profiles;
+			context->profiles = codeGen.profile;
+		} else {
+			pfree(codeGen.profile);
+		}
+	} else if (codeGen.profile && !canbuild) {
+		pfree(codeGen.profile);
 	}
-	free(codeGen.offsets);
-	if (codeGen.trampoline_targets)
-		free(codeGen.trampoline_targets);
 
 	INSTR_TIME_SET_CURRENT(endtime);
-	INSTR_TIME_SET_ZERO(context->base.instr.generation_counter);
-	INSTR_TIME_ACCUM_DIFF(context->base.instr.generation_counter,
-						  endtime, starttime);
+	if (canbuild) {
+		context->base.instr.created_functions++;
+		context->counters.compiled_steps += state->steps_len;
+		context->counters.inlined_calls += codeGen.inlined_calls;
+		context->counters.callout_steps += codeGen.callout_steps;
+		context->counters.code_bytes += total_size;
+	} else {
+		context->counters.fallbacks++;
+	}
 
-	if (DEBUG_GEN || SHOW_TIME)
-		elog(WARNING, "Total JIT duration is %lius", INSTR_TIME_GET_MICROSEC(context->base.instr.generation_counter));
+	// The three counters do not overlap, the total shown by EXPLAIN is their sum
+	INSTR_TIME_ACCUM_DIFF(context->base.instr.inlining_counter, emissiontime, selectiontime);
+	INSTR_TIME_ACCUM_DIFF(context->base.instr.emission_counter, endtime, emissiontime);
+	duration = selectiontime;
+	INSTR_TIME_SUBTRACT(duration, starttime);
+	INSTR_TIME_ADD(context->base.instr.generation_counter, duration);
+
+	duration = endtime;
+	INSTR_TIME_SUBTRACT(duration, starttime);
+	if (DEBUG_GEN)
+		elog(WARNING, "Total JIT duration is %lius", (long) INSTR_TIME_GET_MICROSEC(duration));
+	if (shared)
+		report_compile(&codeGen, canbuild, INSTR_TIME_GET_MICROSEC(duration), total_size);
 	return canbuild;
 }
 
+/*
+ * SQL functions of the extension, showing the shared statistics
+ */
+PG_FUNCTION_INFO_V1(pg_stat_copyjit);
+PG_FUNCTION_INFO_V1(pg_stat_copyjit_failures);
+PG_FUNCTION_INFO_V1(pg_stat_copyjit_compile_times);
+PG_FUNCTION_INFO_V1(pg_stat_copyjit_backends);
+PG_FUNCTION_INFO_V1(pg_stat_copyjit_reset);
+PG_FUNCTION_INFO_V1(pg_copyjit_memory);
+
+static void
+check_shared(void)
+{
+	if (shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("copyjit statistics are not available"),
+				 errhint("Add copyjit to shared_preload_libraries.")));
+}
+
+static Tuplestorestate *
+materialize_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	*tupdesc = CreateTupleDescCopy(*tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+	return tupstore;
+}
+
+Datum
+pg_stat_copyjit(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[7];
+	bool nulls[7];
+
+	check_shared();
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(pg_atomic_read_u64(&shared->compiles));
+	values[1] = Int64GetDatum(pg_atomic_read_u64(&shared->failed_compiles));
+	values[2] = Int64GetDatum(pg_atomic_read_u64(&shared->fallbacks));
+	values[3] = Int64GetDatum(pg_atomic_read_u64(&shared->bytes_emitted));
+	values[4] = Int64GetDatum(pg_atomic_read_u64(&shared->template_hits));
+	values[5] = Int64GetDatum(pg_atomic_read_u64(&shared->template_misses));
+	values[6] = Int64GetDatum(pg_atomic_read_u64(&shared->compile_time_us));
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+Datum
+pg_stat_copyjit_failures(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+
+	check_shared();
+	tupstore = materialize_srf(fcinfo, &tupdesc);
+	for (int opcode = 0 ; opcode < EEOP_LAST ; opcode++) {
+		uint64 failures = pg_atomic_read_u64(&shared->unsupported[opcode]);
+		Datum values[2];
+		bool nulls[2] = {false, false};
+
+		if (failures == 0)
+			continue;
+		values[0] = CStringGetTextDatum(opcodeNames[opcode]);
+		values[1] = Int64GetDatum(failures);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	return (Datum) 0;
+}
+
+Datum
+pg_stat_copyjit_compile_times(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+
+	check_shared();
+	tupstore = materialize_srf(fcinfo, &tupdesc);
+	for (int bucket = 0 ; bucket < COMPILE_TIME_BUCKETS ; bucket++) {
+		Datum values[3];
+		bool nulls[3] = {false, false, false};
+
+		values[0] = Int64GetDatum(bucket == 0 ? 0 : INT64CONST(1) << (bucket - 1));
+		values[1] = Int64GetDatum(INT64CONST(1) << bucket);
+		nulls[1] = bucket == COMPILE_TIME_BUCKETS - 1;
+		values[2] = Int64GetDatum(pg_atomic_read_u64(&shared->compile_times[bucket]));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	return (Datum) 0;
+}
+
+Datum
+pg_stat_copyjit_backends(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+
+	check_shared();
+	tupstore = materialize_srf(fcinfo, &tupdesc);
+	for (int i = 0 ; i < shared->slot_count ; i++) {
+		BackendSlot *slot = &shared->slots[i];
+		int pid = slot->pid;
+		Datum values[3];
+		bool nulls[3] = {false, false, false};
+
+		if (pid == 0)
+			continue;
+		values[0] = Int32GetDatum(pid);
+		values[1] = Int64GetDatum(pg_atomic_read_u64(&slot->code_bytes));
+		values[2] = Int64GetDatum(pg_atomic_read_u64(&slot->arena_bytes));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	return (Datum) 0;
+}
+
+Datum
+pg_stat_copyjit_reset(PG_FUNCTION_ARGS)
+{
+	check_shared();
+	pg_atomic_write_u64(&shared->compiles, 0);
+	pg_atomic_write_u64(&shared->failed_compiles, 0);
+	pg_atomic_write_u64(&shared->fallbacks, 0);
+	pg_atomic_write_u64(&shared->bytes_emitted, 0);
+	pg_atomic_write_u64(&shared->template_hits, 0);
+	pg_atomic_write_u64(&shared->template_misses, 0);
+	pg_atomic_write_u64(&shared->compile_time_us, 0);
+	for (int i = 0 ; i < COMPILE_TIME_BUCKETS ; i++)
+		pg_atomic_write_u64(&shared->compile_times[i], 0);
+	for (int i = 0 ; i < EEOP_LAST ; i++)
+		pg_atomic_write_u64(&shared->unsupported[i], 0);
+	PG_RETURN_VOID();
+}
+
+/*
+ * Memory used by this backend, available without shared_preload_libraries.
+ */
+Datum
+pg_copyjit_memory(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[4];
+	bool nulls[4];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int32GetDatum(code_region_count);
+	values[1] = Int64GetDatum(code_memory);
+	values[2] = Int64GetDatum(arena_bytes());
+	values[3] = Int64GetDatum(store.pending_bytes);
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
 /*
  * Initialize copy-and-patch JIT provider.
  */
@@ -713,7 +3767,120 @@ _PG_jit_provider_init(JitProviderCallbacks *cb)
 void
 _PG_init(void)
 {
-	initialize_stencils();
+	if (process_shared_preload_libraries_in_progress) {
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = copyjit_shmem_request;
+#else
+		RequestAddinShmemSpace(shared_size());
+#endif
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = copyjit_shmem_startup;
+	}
+	// Also installed when loaded as the JIT provider, before the end of the first compiled query
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = copyjit_ExecutorEnd;
+
+	DefineCustomIntVariable("copyjit.tier_up_threshold",
+							"Recompile with LLVM the expressions evaluated this many times.",
+							"Zero disables tier-up. Requires the llvmjit provider to be installed.",
+							&copyjit_tier_up_threshold,
+							0, 0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomRealVariable("copyjit.above_cost",
+							 "Compile expressions only for queries costing more than this.",
+							 "Applied after jit_above_cost. Zero compiles every expression the core asks for.",
+							 &copyjit_above_cost,
+							 0, 0, DBL_MAX,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomRealVariable("copyjit.memoize_min_cost",
+							 "Memoize the results of immutable functions costing at least this.",
+							 "Zero disables memoization. Only functions taking and returning by-value or varlena types are memoized.",
+							 &copyjit_memoize_min_cost,
+							 0, 0, DBL_MAX,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("copyjit.min_steps",
+							"Do not compile expressions having fewer steps than this.",
+							NULL,
+							&copyjit_min_steps,
+							3, 0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("copyjit.max_code_bytes",
+							"Do not compile expressions generating more code than this.",
+							"Zero means no limit.",
+							&copyjit_max_code_bytes,
+							0, 0, INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_BYTE,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("copyjit.max_code_memory",
+							"Maximum amount of generated code mapped by a backend.",
+							"Expressions are left to the interpreter once it is reached. Zero means no limit.",
+							&copyjit_max_code_memory,
+							0, 0, INT_MAX / 1024,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+	DefineCustomBoolVariable("copyjit.explain_counters",
+							 "Report copyjit counters at the end of instrumented executions, like EXPLAIN ANALYZE.",
+							 "Sent as a notice once the execution completed, auto_explain with log_analyze included.",
+							 &copyjit_explain_counters,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomBoolVariable("copyjit.profile",
+							 "Count the evaluations of every step of the compiled expressions.",
+							 "The counts are logged at the end of the query. The generated code is slower.",
+							 &copyjit_profile,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("copyjit.pgo_evaluations",
+							"Recompile expressions after profiling this many evaluations.",
+							"Zero disables profile-guided recompilation.",
+							&copyjit_pgo_evaluations,
+							0, 0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomStringVariable("copyjit.template_store",
+							   "File keeping the compiled templates from one backend to the next.",
+							   "Backends read it when they first compile an expression and add their templates when exiting. Empty disables it.",
+							   &copyjit_template_store,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   NULL, NULL, NULL);
+	DefineCustomEnumVariable("copyjit.perf_output",
+							 "Write symbols of the generated code for perf.",
+							 "map writes /tmp/perf-<pid>.map, jitdump writes /tmp/jit-<pid>.dump with the code, for perf inject --jit.",
+							 &copyjit_perf_output,
+							 PERF_OUTPUT_OFF,
+							 perf_output_options,
+							 PGC_SUSET,
+							 0,
+							 NULL, NULL, NULL);
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("copyjit");
+#else
+	EmitWarningsOnPlaceholders("copyjit");
+#endif
+
+	prepare_stencil_programs();
+	// Loaded by the postmaster, backends read the store once forked
+	if (!process_shared_preload_libraries_in_progress)
+		load_template_store();
 }
 
 void
@@ -0,0 +1,75 @@
+/*
+ * Copy-patch JIT for PostgreSQL
+ *
+ * Structures shared between the stencils and the code generator.
+ */
+#ifndef COPYJIT_H
+#define COPYJIT_H
+
+/*
+ * Result of a SQLValueFunction, computed on the first evaluation and kept for
+ * the lifetime of the expression. These functions are all stable.
+ */
+typedef struct SQLValueCache
+{
+	bool		valid;
+	bool		isnull;
+	Datum		value;
+	MemoryContext cxt;	/* where to evaluate, must outlive the expression */
+} SQLValueCache;
+
+/*
+ * One assignment of a scattered run of ASSIGN_*_VAR steps. The resultnum is
+ * relative to the first step of the run.
+ */
+typedef struct AssignVarPair
+{
+	int			attnum;
+	int			resultnum;
+} AssignVarPair;
+
+/*
+ * Constant key of a jsonb -> or ->> operator, detoasted once for the lifetime
+ * of the expression.
+ */
+typedef struct JsonbConstKey
+{
+	const char *data;
+	int			len;
+} JsonbConstKey;
+
+/*
+ * Results of an immutable function, direct-mapped on a hash of its arguments.
+ * The key of an entry holds, for each argument, a null marker then the Datum
+ * of a by-value argument or the length and bytes of a varlena.
+ */
+#define MEMO_ENTRIES		64		/* a power of 2 */
+#define MEMO_KEY_SIZE		64
+#define MEMO_MAX_ARGS		4
+#define MEMO_PROBE_LOOKUPS	1024	/* lookups before checking the hit rate */
+#define MEMO_MIN_HIT_RATE	4		/* at least one hit every 4 lookups */
+#define MEMO_MAX_BYTES		(64 * 1024)	/* of results copied, evicted ones included */
+
+typedef struct MemoEntry
+{
+	int			keylen;			/* 0 for an empty entry */
+	bool		isnull;
+	Datum		value;			/* copied in the cache context when by reference */
+	char		key[MEMO_KEY_SIZE];
+} MemoEntry;
+
+typedef struct MemoCache
+{
+	struct MemoCache *next;		/* caches of the same JIT context */
+	MemoryContext cxt;
+	bool		disabled;		/* too few hits, only call the function */
+	bool		resultbyval;
+	int16		resulttyplen;
+	Size		stored_bytes;	/* results copied in cxt, freed with it */
+	uint32		varlena_args;	/* bit set for the varlena arguments */
+	uint64		hits;
+	uint64		misses;
+	MemoEntry	entries[MEMO_ENTRIES];
+} MemoCache;
+
+#endif							/* COPYJIT_H */
@@ -1,6 +1,7 @@
 #!/usr/bin/env python3
 
 import json
+import re
 import sys
 
 ## XXX TODO : create python enums for relkind, target...
@@ -35,8 +36,21 @@ typedef enum Target {
     TARGET_FUNC_ARG,
     TARGET_JUMP_DONE,
     TARGET_JUMP_NULL,
+    TARGET_JUMP_DISTINCT,
     TARGET_RESULTSLOT_VALUES,
     TARGET_RESULTSLOT_ISNULL,
+    TARGET_PARAM_LIST,
+    TARGET_PARAM_EXTERN_DATA,
+    TARGET_SVF_CACHE,
+    TARGET_ASSIGN_COUNT,
+    TARGET_ASSIGN_TABLE,
+    TARGET_PROFILE_COUNTER,
+    TARGET_JSONB_KEY,
+    TARGET_MEMO_CACHE,
+    TARGET_COMMON_VALUE,
+    TARGET_COMMON_ISNULL,
+    TARGET_CALL_RESVALUE,
+    TARGET_CALL_RESNULL,
     TARGET_MakeExpandedObjectReadOnlyInternal,  // TODO : replace this and followings with a TARGET_FUNCTION_CALL and a Patch::function_name ?
     TARGET_slot_getsomeattrs_int,
     TARGET_ExecEvalScalarArrayOp,               // TODO : used as is, should be reimplemented but I wanted to show it can be quick this way
@@ -45,6 +59,17 @@ typedef enum Target {
     TARGET_ExecEvalParamExec,                   // should be fine too
     TARGET_ExecEvalParamExtern,                 // should be fine too
     TARGET_CurrentMemoryContext,
+    TARGET_ExecAggInitGroup,
+    TARGET_ExecAggTransReparent,                // PostgreSQL < 16
+    TARGET_ExecAggCopyTransValue,               // PostgreSQL >= 16
+    TARGET_ExecEvalPreOrderedDistinctSingle,
+    TARGET_ExecEvalPreOrderedDistinctMulti,
+    TARGET_ExecEvalFieldSelect,
+    TARGET_pg_detoast_datum,
+    TARGET_getKeyJsonValueFromContainer,
+    TARGET_JsonbValueToJsonb,
+    TARGET_cstring_to_text_with_len,
+    TARGET_datumCopy,
 } Target;
 
 typedef struct Patch {
@@ -58,24 +83,25 @@ typedef struct Stencil {
     size_t code_size;
     const unsigned char *code;
     size_t patch_size;
-    const Patch *patches;
+    const Patch *patches;       // static patches first, then grouped by target
+    size_t static_patch_size;   // patches that can be applied once, at load time
+    int id;                     // index in all_stencils
 } Stencil;
 
-
-Stencil stencils[EEOP_LAST];
-"""
-
-
-## Not fond of this, it would be better as a fully static array. will do for now.
-prefix_initializer = """
-void initialize_stencils() {
-    for (int i = 0 ; i < EEOP_LAST ; i++) {
-        // mark all stencils as uninitialized
-        stencils[i].code_size = -1;
-    }
 """
 
-postfix_initializer = "}"
+# Holes that depend on the compiled expression are named in capitals in
+# stencils.c (OP, CONST_VALUE, NEXT_CALL...). Any other symbol is a PostgreSQL
+# function or global variable, its address is the same for every expression.
+# Only absolute relocations can be applied before the code is at its final
+# location.
+ABSOLUTE_RELKINDS = (
+    "R_X86_64_64",
+    "R_AARCH64_MOVW_UABS_G0_NC",
+    "R_AARCH64_MOVW_UABS_G1_NC",
+    "R_AARCH64_MOVW_UABS_G2_NC",
+    "R_AARCH64_MOVW_UABS_G3",
+)
 
 class Patch(object):
     def __init__ (self, target, kind, offset, addend):
@@ -87,6 +113,9 @@ class Patch(object):
         self.offset = offset
         self.addend = addend
 
+    def is_static(self):
+        return not self.target.isupper() and self.kind in ABSOLUTE_RELKINDS
+
     def dump_patch(self, out_fd):
         out_fd.write("{%s, RELKIND_%s, TARGET_%s, %s}," % (self.offset, self.kind, self.target, self.addend))
 
@@ -160,6 +189,13 @@ class Stencil(object):
     def dump_code(self, out_fd):
         out_fd.write("const unsigned char %s__code[%s] = {%s};\n" % (self.name, len(self.code), ", ".join([hex(x) for x in self.code])))
 
+    def sort_patches(self):
+        # static patches first, the code generator only walks the others
+        self.patches.sort(key=lambda patch: (not patch.is_static(), patch.target, patch.offset))
+
+    def static_patch_count(self):
+        return len([patch for patch in self.patches if patch.is_static()])
+
     def dump_patches(self, out_fd):
         if len(self.patches) == 0:
             out_fd.write("// No patch for %s\n" % self.name)
@@ -169,19 +205,22 @@ class Stencil(object):
                 patch.dump_patch(out_fd)
             out_fd.write("};\n")
 
+    def dump_fields(self):
+        patches = "%s__patches" % self.name if len(self.patches) > 0 else "NULL"
+        return "{ .code_size = %s, .code = %s__code, .patch_size = %s, .patches = %s, .static_patch_size = %s, .id = %s }" % (len(self.code), self.name, len(self.patches), patches, self.static_patch_count(), self.id)
+
     def dump_initializer(self, out_fd):
-        if len(self.patches) == 0:
-            out_fd.write("stencils[%s].code_size = %s; stencils[%s].code = %s__code; stencils[%s].patch_size = 0;\n" % (self.name, len(self.code), self.name, self.name, self.name))
-        else:
-            out_fd.write("stencils[%s].code_size = %s; stencils[%s].code = %s__code;\n" % (self.name, len(self.code), self.name, self.name))
-            out_fd.write("stencils[%s].patch_size = %s; stencils[%s].patches = %s__patches;\n" % (self.name, len(self.patches), self.name, self.name))
+        out_fd.write("    [%s] = %s,\n" % (self.name, self.dump_fields()))
+
+    def reference(self):
+        return "&stencils[%s]" % self.name
 
 class ExtraStencil(Stencil):
     def dump_initializer(self, out_fd):
-        if len(self.patches) == 0:
-            out_fd.write("struct Stencil %s = { .code_size = %s, .code = %s__code, .patch_size = 0; };\n" % (self.name, len(self.code), self.name))
-        else:
-            out_fd.write("struct Stencil %s = { .code_size = %s, .code = %s__code, .patch_size = %s, .patches = %s__patches };\n" % (self.name, len(self.code), self.name, len(self.patches), self.name))
+        out_fd.write("const Stencil %s = %s;\n" % (self.name, self.dump_fields()))
+
+    def reference(self):
+        return "&%s" % self.name
 
 def sections_iterator(sections, major):
     for section in sections:
@@ -207,7 +246,24 @@ def symbols_iterator(symbols, major):
         else:
             yield (symbol["Name"]["Name"], symbol["Value"], symbol["Size"], symbol)
 
-def generate_stencil(readobj_major, in_filename, out_filename):
+def parse_opcodes(header_filename):
+    # The ExprEvalOp values of the server the stencils are built for, in order
+    with open(header_filename, "r") as header:
+        source = header.read()
+    enum = re.search(r"typedef\s+enum\s+ExprEvalOp\s*\{(.*?)\}\s*ExprEvalOp\s*;", source, re.S)
+    if enum is None:
+        raise Exception("ExprEvalOp not found in %s" % header_filename)
+    body = re.sub(r"/\*.*?\*/", "", enum.group(1), flags=re.S)
+    body = re.sub(r"//[^\n]*", "", body)
+    return re.findall(r"\b(EEOP_\w+)\b", body)
+
+def dump_opcode_names(opcodes, out_fd):
+    out_fd.write("\nstatic const char *const opcodeNames[EEOP_LAST + 1] = {\n")
+    for opcode in opcodes:
+        out_fd.write("    [%s] = \"%s\",\n" % (opcode, opcode))
+    out_fd.write("};\n")
+
+def generate_stencil(readobj_major, in_filename, out_filename, opcodes):
     objdump = json.load(open(in_filename, "r"))
     stencils_o = objdump[0]
     if readobj_major < 15 and type(stencils_o) == dict:
@@ -248,22 +304,30 @@ def generate_stencil(readobj_major, in_filename, out_filename):
 
     with open(out_filename, "w") as out_fd:
         out_fd.write(prefix)
-        for stencil in stencils + extra_stencils:
+        for (id, stencil) in enumerate(stencils + extra_stencils):
+            stencil.id = id
             stencil.strip_code()
+            stencil.sort_patches()
             stencil.dump_code(out_fd)
             stencil.dump_patches(out_fd)
 
-        out_fd.write(prefix_initializer)
+        # opcodes without a stencil are left zeroed, with a NULL code
+        out_fd.write("\nconst Stencil stencils[EEOP_LAST] = {\n")
         for stencil in stencils:
             stencil.dump_initializer(out_fd)
-        out_fd.write(postfix_initializer)
+        out_fd.write("};\n\n")
         for extra in extra_stencils:
             extra.dump_initializer(out_fd)
 
+        out_fd.write("\n#define STENCIL_COUNT %s\n" % len(stencils + extra_stencils))
+        out_fd.write("const Stencil *const all_stencils[STENCIL_COUNT] = {%s};\n" % ", ".join([stencil.reference() for stencil in stencils + extra_stencils]))
+        dump_opcode_names(opcodes, out_fd)
+
 if __name__ == "__main__":
-    # args readobj-version source.json target.c
+    # args readobj-version source.json target.c execExpr.h
     readobj_version = sys.argv[1]
     major_version = int(readobj_version.split('.')[0])
     filename = sys.argv[2]
     output = sys.argv[3]
-    generate_stencil(major_version, filename, output)
+    opcodes = parse_opcodes(sys.argv[4])
+    generate_stencil(major_version, filename, output, opcodes)
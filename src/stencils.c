@@ -4,15 +4,27 @@
 
 #include "jit/jit.h"
 
+#include "catalog/pg_type.h"
+
 #include "executor/execExpr.h"
 #include "executor/tuptable.h"
 
 #include "nodes/execnodes.h"
 
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
 #include "utils/expandeddatum.h"
+#include "utils/jsonb.h"
 #include "utils/memutils.h"
+#if PG_VERSION_NUM < 170000
 #include "utils/resowner_private.h"
+#endif
+#if PG_VERSION_NUM >= 180000
+#include "port/pg_bitutils.h"
+#endif
 
+#include "copyjit.h"
 
 #define goto_next __attribute__((musttail)) return NEXT_CALL(expression, econtext, isNull)
 
@@ -29,6 +41,18 @@ extern int ATTNUM;
 extern Datum RESULTSLOT_VALUES;
 extern bool RESULTSLOT_ISNULL;
 extern NullableDatum FUNC_ARG;
+extern void PARAM_LIST;
+extern ParamExternData PARAM_EXTERN_DATA;
+extern SQLValueCache SVF_CACHE;
+extern void ASSIGN_COUNT;
+extern AssignVarPair ASSIGN_TABLE;
+extern uint64 PROFILE_COUNTER;
+extern JsonbConstKey JSONB_KEY;
+extern MemoCache MEMO_CACHE;
+extern Datum COMMON_VALUE;
+extern bool COMMON_ISNULL;
+extern Datum CALL_RESVALUE;
+extern bool CALL_RESNULL;
 
 extern ExprEvalStep op;
 
@@ -36,13 +60,27 @@ extern Datum FORCE_NEXT_CALL   (struct ExprState *expression, struct ExprContext
 extern Datum NEXT_CALL   (struct ExprState *expression, struct ExprContext *econtext, bool *isNull);
 extern Datum JUMP_DONE   (struct ExprState *expression, struct ExprContext *econtext, bool *isNull);
 extern Datum JUMP_NULL   (struct ExprState *expression, struct ExprContext *econtext, bool *isNull);
+extern Datum JUMP_DISTINCT   (struct ExprState *expression, struct ExprContext *econtext, bool *isNull);
 extern Datum FUNC_CALL   (FunctionCallInfo fcinfo);
 
+#if PG_VERSION_NUM >= 180000
+Datum stencil_EEOP_DONE_RETURN (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+    *isNull = expression->resnull;
+    return expression->resvalue;
+}
+
+Datum stencil_EEOP_DONE_NO_RETURN (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+    return (Datum) 0;
+}
+#else
 Datum stencil_EEOP_DONE (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
     *isNull = expression->resnull;
     return expression->resvalue;
 }
+#endif
 
 Datum stencil_EEOP_CONST (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
@@ -125,6 +163,117 @@ Datum extra_EEOP_FUNCEXPR_STRICT_int4lt (struct ExprState *expression, struct Ex
 	goto_next;
 }
 
+/*
+ * FUNCEXPR of an immutable function, with its results kept in MEMO_CACHE.
+ * Strict functions get their checkers before. Arguments too long for the key
+ * skip the cache, and the cache disables itself when it is seldom hit.
+ */
+Datum extra_EEOP_FUNCEXPR_MEMOIZED (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	FunctionCallInfo fcinfo = op.d.func.fcinfo_data;
+	MemoCache *cache = &MEMO_CACHE;
+	MemoEntry *entry;
+	char key[MEMO_KEY_SIZE];
+	int keylen = 0;
+	uint32 hash = 2166136261u;
+	MemoryContext oldcontext;
+	Datum d;
+
+	if (cache->disabled)
+		goto call;
+	for (int argno = 0 ; argno < op.d.func.nargs ; argno++) {
+		NullableDatum *arg = &fcinfo->args[argno];
+		const char *bytes;
+		int len;
+
+		if (keylen + 2 + (int) sizeof(Datum) > MEMO_KEY_SIZE)
+			goto call;
+		key[keylen++] = arg->isnull;
+		if (arg->isnull)
+			continue;
+		if (cache->varlena_args & (1 << argno)) {
+			const struct varlena *v = (const struct varlena *) DatumGetPointer(arg->value);
+
+			if (VARATT_IS_EXTERNAL(v) || VARATT_IS_COMPRESSED(v))
+				goto call;
+			len = VARSIZE_ANY_EXHDR(v);
+			if (keylen + 1 + len > MEMO_KEY_SIZE)
+				goto call;
+			key[keylen++] = len;
+			bytes = VARDATA_ANY(v);
+		} else {
+			len = sizeof(Datum);
+			bytes = (const char *) &arg->value;
+		}
+		for (int b = 0 ; b < len ; b++)
+			key[keylen++] = bytes[b];
+	}
+	for (int b = 0 ; b < keylen ; b++)
+		hash = (hash ^ (unsigned char) key[b]) * 16777619u;
+
+	entry = &cache->entries[hash & (MEMO_ENTRIES - 1)];
+	if (entry->keylen == keylen) {
+		int b = 0;
+
+		while (b < keylen && entry->key[b] == key[b])
+			b++;
+		if (b == keylen) {
+			cache->hits++;
+			*op.resvalue = entry->value;
+			*op.resnull = entry->isnull;
+			goto_next;
+		}
+	}
+
+	cache->misses++;
+	fcinfo->isnull = false;
+	d = FUNC_CALL(fcinfo);
+	*op.resvalue = d;
+	*op.resnull = fcinfo->isnull;
+
+	// An evicted value may still be used by a later step, it stays in the cache
+	// context until the end of the query. A full cache keeps its entries.
+	if (fcinfo->isnull || cache->resultbyval || cache->stored_bytes < MEMO_MAX_BYTES) {
+		// Not found if the copy fails
+		entry->keylen = 0;
+		entry->isnull = fcinfo->isnull;
+		if (fcinfo->isnull || cache->resultbyval) {
+			entry->value = d;
+		} else {
+			oldcontext = MemoryContextSwitchTo(cache->cxt);
+			entry->value = datumCopy(d, false, cache->resulttyplen);
+			MemoryContextSwitchTo(oldcontext);
+			// Only varlena results are not by value, see function_is_memoizable
+			cache->stored_bytes += VARSIZE_ANY(DatumGetPointer(entry->value));
+		}
+		entry->keylen = keylen;
+		for (int b = 0 ; b < keylen ; b++)
+			entry->key[b] = key[b];
+	}
+
+	if (cache->hits + cache->misses == MEMO_PROBE_LOOKUPS && cache->hits * MEMO_MIN_HIT_RATE < MEMO_PROBE_LOOKUPS)
+		cache->disabled = true;
+	goto_next;
+
+call:
+	fcinfo->isnull = false;
+	d = FUNC_CALL(fcinfo);
+	*op.resvalue = d;
+	*op.resnull = fcinfo->isnull;
+	goto_next;
+}
+
+/*
+ * A call made earlier in the expression with the same arguments, replacing
+ * the call and the steps computing its arguments: copy its result.
+ */
+Datum extra_EEOP_FUNCEXPR_COMMON (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	CALL_RESVALUE = COMMON_VALUE;
+	CALL_RESNULL = COMMON_ISNULL;
+	goto_next;
+}
+
 #if 1
 Datum extra_EEOP_FUNCEXPR_STRICT_CHECKER (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
@@ -137,6 +286,20 @@ Datum extra_EEOP_FUNCEXPR_STRICT_CHECKER (struct ExprState *expression, struct E
 	}
 	goto_next;
 }
+
+/* Profiling mode: same as above, counting the strict fails */
+Datum extra_EEOP_FUNCEXPR_STRICT_CHECKER_PROFILED (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	if (FUNC_ARG.isnull)
+	{
+		PROFILE_COUNTER++;
+		*op.resnull = true;
+
+		__attribute__((musttail))
+		return FORCE_NEXT_CALL(expression, econtext, isNull);
+	}
+	goto_next;
+}
 #else
 Datum stencil_EEOP_FUNCEXPR_STRICT (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
@@ -190,12 +353,64 @@ Datum stencil_EEOP_QUAL (struct ExprState *expression, struct ExprContext *econt
 	goto_next;
 }
 
+/* Profiling mode: same as above, counting the early exits */
+Datum extra_EEOP_QUAL_PROFILED (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	if (*op.resnull ||
+		!DatumGetBool(*op.resvalue))
+	{
+		PROFILE_COUNTER++;
+		*op.resnull = false;
+		*op.resvalue = BoolGetDatum(false);
+
+		__attribute__((musttail))
+		return JUMP_DONE(expression, econtext, isNull);
+	}
+
+	goto_next;
+}
+
+/* Profiling mode: counts the evaluations of the following step */
+Datum extra_PROFILE_STEP (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	PROFILE_COUNTER++;
+	goto_next;
+}
+
+/* Jumps to the step following the one of the record: around the steps moved out of line */
+Datum extra_JUMP_NEXT_STEP (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	__attribute__((musttail))
+	return FORCE_NEXT_CALL(expression, econtext, isNull);
+}
+
 Datum stencil_EEOP_SQLVALUEFUNCTION (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
 	ExecEvalSQLValueFunction(expression, &op);
 	goto_next;
 }
 
+Datum extra_EEOP_SQLVALUEFUNCTION_CACHED (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	if (likely(SVF_CACHE.valid))
+	{
+		*op.resvalue = SVF_CACHE.value;
+		*op.resnull = SVF_CACHE.isnull;
+	}
+	else
+	{
+		/* by-reference results must survive the per-tuple memory */
+		MemoryContext oldContext = MemoryContextSwitchTo(SVF_CACHE.cxt);
+
+		ExecEvalSQLValueFunction(expression, &op);
+		MemoryContextSwitchTo(oldContext);
+		SVF_CACHE.value = *op.resvalue;
+		SVF_CACHE.isnull = *op.resnull;
+		SVF_CACHE.valid = true;
+	}
+	goto_next;
+}
+
 Datum stencil_EEOP_SCAN_SYSVAR (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
 	ExecEvalSysVar(expression, &op, econtext, econtext->ecxt_scantuple);
@@ -311,6 +526,74 @@ Datum stencil_EEOP_ASSIGN_OUTER_VAR (struct ExprState *expression, struct ExprCo
 	goto_next;
 }
 
+/*
+ * Runs of ASSIGN_*_VAR steps from the same slot. The holes are the ones of
+ * the first step of the run, ASSIGN_COUNT is the length of the run.
+ * Contiguous runs are copied as a block, scattered ones through a table.
+ */
+#define ASSIGN_VAR_BLOCK(slot) \
+	do { \
+		Datum *src_values = &(slot)->tts_values[op.d.assign_var.attnum]; \
+		bool *src_nulls = &(slot)->tts_isnull[op.d.assign_var.attnum]; \
+		Datum *dst_values = &RESULTSLOT_VALUES; \
+		bool *dst_nulls = &RESULTSLOT_ISNULL; \
+		int count = (int) (intptr_t) &ASSIGN_COUNT; \
+		for (int i = 0; i < count; i++) \
+		{ \
+			dst_values[i] = src_values[i]; \
+			dst_nulls[i] = src_nulls[i]; \
+		} \
+	} while (0)
+
+#define ASSIGN_VAR_TABLE(slot) \
+	do { \
+		const AssignVarPair *table = &ASSIGN_TABLE; \
+		Datum *dst_values = &RESULTSLOT_VALUES; \
+		bool *dst_nulls = &RESULTSLOT_ISNULL; \
+		int count = (int) (intptr_t) &ASSIGN_COUNT; \
+		for (int i = 0; i < count; i++) \
+		{ \
+			dst_values[table[i].resultnum] = (slot)->tts_values[table[i].attnum]; \
+			dst_nulls[table[i].resultnum] = (slot)->tts_isnull[table[i].attnum]; \
+		} \
+	} while (0)
+
+Datum extra_EEOP_ASSIGN_SCAN_VAR_BLOCK (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	ASSIGN_VAR_BLOCK(econtext->ecxt_scantuple);
+	goto_next;
+}
+
+Datum extra_EEOP_ASSIGN_SCAN_VAR_TABLE (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	ASSIGN_VAR_TABLE(econtext->ecxt_scantuple);
+	goto_next;
+}
+
+Datum extra_EEOP_ASSIGN_INNER_VAR_BLOCK (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	ASSIGN_VAR_BLOCK(econtext->ecxt_innertuple);
+	goto_next;
+}
+
+Datum extra_EEOP_ASSIGN_INNER_VAR_TABLE (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	ASSIGN_VAR_TABLE(econtext->ecxt_innertuple);
+	goto_next;
+}
+
+Datum extra_EEOP_ASSIGN_OUTER_VAR_BLOCK (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	ASSIGN_VAR_BLOCK(econtext->ecxt_outertuple);
+	goto_next;
+}
+
+Datum extra_EEOP_ASSIGN_OUTER_VAR_TABLE (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	ASSIGN_VAR_TABLE(econtext->ecxt_outertuple);
+	goto_next;
+}
+
 Datum stencil_EEOP_SCALARARRAYOP (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
 	ExecEvalScalarArrayOp(expression, &op);
@@ -343,11 +626,25 @@ Datum stencil_EEOP_JUMP_IF_NOT_TRUE (struct ExprState *expression, struct ExprCo
 
 }
 
-Datum stencil_EEOP_JUMP (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+/* Profiling mode: same as above, counting the jumps */
+Datum extra_EEOP_JUMP_IF_NOT_TRUE_PROFILED (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
+	if (*op.resnull || !DatumGetBool(*op.resvalue))
+	{
+		PROFILE_COUNTER++;
+		__attribute__((musttail))
+		return JUMP_DONE(expression, econtext, isNull);
+	}
+
 	goto_next;
 }
 
+Datum stencil_EEOP_JUMP (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	__attribute__((musttail))
+	return JUMP_DONE(expression, econtext, isNull);
+}
+
 Datum stencil_EEOP_DISTINCT (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
 	FunctionCallInfo fcinfo = op.d.func.fcinfo_data;
@@ -423,6 +720,22 @@ Datum stencil_EEOP_PARAM_EXTERN (struct ExprState *expression, struct ExprContex
 	goto_next;
 }
 
+/*
+ * The parameter list of a generic plan does not change during its execution.
+ * The type check was done when compiling, only the list itself is checked here.
+ */
+Datum extra_EEOP_PARAM_EXTERN_DIRECT (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	if (likely(econtext->ecxt_param_list_info == (ParamListInfo) &PARAM_LIST))
+	{
+		*op.resvalue = PARAM_EXTERN_DATA.value;
+		*op.resnull = PARAM_EXTERN_DATA.isnull;
+	}
+	else
+		ExecEvalParamExtern(expression, &op, econtext);
+	goto_next;
+}
+
 Datum stencil_EEOP_AGGREF (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
 #if PG_VERSION_NUM < 140000
@@ -467,6 +780,117 @@ ExecAggPlainTransByVal(AggState *aggstate, AggStatePerTrans pertrans,
 	MemoryContextSwitchTo(oldContext);
 }
 
+static pg_attribute_always_inline void
+ExecAggPlainTransByRef(AggState *aggstate, AggStatePerTrans pertrans,
+					   AggStatePerGroup pergroup,
+					   ExprContext *aggcontext, int setno)
+{
+	FunctionCallInfo fcinfo = pertrans->transfn_fcinfo;
+	MemoryContext oldContext;
+	Datum		newVal;
+
+	/* cf. select_current_set() */
+	aggstate->curaggcontext = aggcontext;
+	aggstate->current_set = setno;
+
+	/* set up aggstate->curpertrans for AggGetAggref() */
+	aggstate->curpertrans = pertrans;
+
+	/* invoke transition function in per-tuple context */
+	oldContext = MemoryContextSwitchTo(aggstate->tmpcontext->ecxt_per_tuple_memory);
+
+	fcinfo->args[0].value = pergroup->transValue;
+	fcinfo->args[0].isnull = pergroup->transValueIsNull;
+	fcinfo->isnull = false;		/* just in case transfn doesn't set it */
+
+	newVal = FunctionCallInvoke(fcinfo);
+
+	/*
+	 * For pass-by-ref datatype, must copy the new value into aggcontext and
+	 * free the prior transValue.  But if transfn returned a pointer to its
+	 * first input, we don't need to do anything.
+	 */
+	if (DatumGetPointer(newVal) != DatumGetPointer(pergroup->transValue))
+#if PG_VERSION_NUM < 160000
+		newVal = ExecAggTransReparent(aggstate, pertrans,
+									  newVal, fcinfo->isnull,
+									  pergroup->transValue,
+									  pergroup->transValueIsNull);
+#else
+		newVal = ExecAggCopyTransValue(aggstate, pertrans,
+									   newVal, fcinfo->isnull,
+									   pergroup->transValue,
+									   pergroup->transValueIsNull);
+#endif
+
+	pergroup->transValue = newVal;
+	pergroup->transValueIsNull = fcinfo->isnull;
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+Datum stencil_EEOP_AGG_STRICT_DESERIALIZE (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	FunctionCallInfo fcinfo = op.d.agg_deserialize.fcinfo_data;
+	AggState   *aggstate = castNode(AggState, expression->parent);
+	MemoryContext oldContext;
+
+	/* Don't call a strict deserialization function with NULL input */
+	if (fcinfo->args[0].isnull)
+		__attribute__((musttail))
+		return JUMP_NULL(expression, econtext, isNull);
+
+	/* We run the deserialization functions in per-input-tuple memory context */
+	oldContext = MemoryContextSwitchTo(aggstate->tmpcontext->ecxt_per_tuple_memory);
+	fcinfo->isnull = false;
+	*op.resvalue = FunctionCallInvoke(fcinfo);
+	*op.resnull = fcinfo->isnull;
+	MemoryContextSwitchTo(oldContext);
+
+	goto_next;
+}
+
+Datum stencil_EEOP_AGG_DESERIALIZE (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	FunctionCallInfo fcinfo = op.d.agg_deserialize.fcinfo_data;
+	AggState   *aggstate = castNode(AggState, expression->parent);
+	MemoryContext oldContext;
+
+	oldContext = MemoryContextSwitchTo(aggstate->tmpcontext->ecxt_per_tuple_memory);
+	fcinfo->isnull = false;
+	*op.resvalue = FunctionCallInvoke(fcinfo);
+	*op.resnull = fcinfo->isnull;
+	MemoryContextSwitchTo(oldContext);
+
+	goto_next;
+}
+
+Datum stencil_EEOP_AGG_PLAIN_TRANS_INIT_STRICT_BYVAL (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	AggState   *aggstate = castNode(AggState, expression->parent);
+	AggStatePerTrans pertrans = op.d.agg_trans.pertrans;
+	AggStatePerGroup pergroup = &aggstate->all_pergroups[op.d.agg_trans.setoff][op.d.agg_trans.transno];
+
+	Assert(pertrans->transtypeByVal);
+
+	if (pergroup->noTransValue)
+	{
+		/* If transValue has not yet been initialized, do so now. */
+		ExecAggInitGroup(aggstate, pertrans, pergroup,
+						 op.d.agg_trans.aggcontext);
+		/* copied trans value from input, done this round */
+	}
+	else if (likely(!pergroup->transValueIsNull))
+	{
+		/* invoke transition function, unless prevented by strictness */
+		ExecAggPlainTransByVal(aggstate, pertrans, pergroup,
+							   op.d.agg_trans.aggcontext,
+							   op.d.agg_trans.setno);
+	}
+
+	goto_next;
+}
+
 Datum stencil_EEOP_AGG_PLAIN_TRANS_STRICT_BYVAL (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
 	AggState   *aggstate = castNode(AggState, expression->parent);
@@ -484,6 +908,97 @@ Datum stencil_EEOP_AGG_PLAIN_TRANS_STRICT_BYVAL (struct ExprState *expression, s
 	goto_next;
 }
 
+Datum stencil_EEOP_AGG_PLAIN_TRANS_BYVAL (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	AggState   *aggstate = castNode(AggState, expression->parent);
+	AggStatePerTrans pertrans = op.d.agg_trans.pertrans;
+	AggStatePerGroup pergroup = &aggstate->all_pergroups[op.d.agg_trans.setoff][op.d.agg_trans.transno];
+
+	Assert(pertrans->transtypeByVal);
+
+	ExecAggPlainTransByVal(aggstate, pertrans, pergroup,
+						   op.d.agg_trans.aggcontext,
+						   op.d.agg_trans.setno);
+
+	goto_next;
+}
+
+Datum stencil_EEOP_AGG_PLAIN_TRANS_INIT_STRICT_BYREF (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	AggState   *aggstate = castNode(AggState, expression->parent);
+	AggStatePerTrans pertrans = op.d.agg_trans.pertrans;
+	AggStatePerGroup pergroup = &aggstate->all_pergroups[op.d.agg_trans.setoff][op.d.agg_trans.transno];
+
+	Assert(!pertrans->transtypeByVal);
+
+	if (pergroup->noTransValue)
+		ExecAggInitGroup(aggstate, pertrans, pergroup,
+						 op.d.agg_trans.aggcontext);
+	else if (likely(!pergroup->transValueIsNull))
+		ExecAggPlainTransByRef(aggstate, pertrans, pergroup,
+							   op.d.agg_trans.aggcontext,
+							   op.d.agg_trans.setno);
+
+	goto_next;
+}
+
+Datum stencil_EEOP_AGG_PLAIN_TRANS_STRICT_BYREF (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	AggState   *aggstate = castNode(AggState, expression->parent);
+	AggStatePerTrans pertrans = op.d.agg_trans.pertrans;
+	AggStatePerGroup pergroup = &aggstate->all_pergroups[op.d.agg_trans.setoff][op.d.agg_trans.transno];
+
+	Assert(!pertrans->transtypeByVal);
+
+	if (likely(!pergroup->transValueIsNull))
+		ExecAggPlainTransByRef(aggstate, pertrans, pergroup,
+							   op.d.agg_trans.aggcontext,
+							   op.d.agg_trans.setno);
+
+	goto_next;
+}
+
+Datum stencil_EEOP_AGG_PLAIN_TRANS_BYREF (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	AggState   *aggstate = castNode(AggState, expression->parent);
+	AggStatePerTrans pertrans = op.d.agg_trans.pertrans;
+	AggStatePerGroup pergroup = &aggstate->all_pergroups[op.d.agg_trans.setoff][op.d.agg_trans.transno];
+
+	Assert(!pertrans->transtypeByVal);
+
+	ExecAggPlainTransByRef(aggstate, pertrans, pergroup,
+						   op.d.agg_trans.aggcontext,
+						   op.d.agg_trans.setno);
+
+	goto_next;
+}
+
+#if PG_VERSION_NUM >= 160000
+Datum stencil_EEOP_AGG_PRESORTED_DISTINCT_SINGLE (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	AggStatePerTrans pertrans = op.d.agg_presorted_distinctcheck.pertrans;
+	AggState   *aggstate = castNode(AggState, expression->parent);
+
+	if (!ExecEvalPreOrderedDistinctSingle(aggstate, pertrans))
+		__attribute__((musttail))
+		return JUMP_DISTINCT(expression, econtext, isNull);
+
+	goto_next;
+}
+
+Datum stencil_EEOP_AGG_PRESORTED_DISTINCT_MULTI (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	AggStatePerTrans pertrans = op.d.agg_presorted_distinctcheck.pertrans;
+	AggState   *aggstate = castNode(AggState, expression->parent);
+
+	if (!ExecEvalPreOrderedDistinctMulti(aggstate, pertrans))
+		__attribute__((musttail))
+		return JUMP_DISTINCT(expression, econtext, isNull);
+
+	goto_next;
+}
+#endif
+
 Datum stencil_EEOP_AGG_PLAIN_PERGROUP_NULLCHECK (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
 {
 	AggState   *aggstate = castNode(AggState, expression->parent);
@@ -510,3 +1025,377 @@ Datum stencil_EEOP_AGG_STRICT_INPUT_CHECK_ARGS (struct ExprState *expression, st
 	}
 	goto_next;
 }
+
+Datum stencil_EEOP_AGG_STRICT_INPUT_CHECK_NULLS (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	bool	   *nulls = op.d.agg_strict_input_check.nulls;
+	int			nargs = op.d.agg_strict_input_check.nargs;
+
+	for (int argno = 0; argno < nargs; argno++)
+	{
+		if (nulls[argno])
+			__attribute__((musttail))
+			return JUMP_NULL(expression, econtext, isNull);
+	}
+	goto_next;
+}
+
+#if PG_VERSION_NUM >= 140000
+/*
+ * Container subscripts. The generic stencils call the functions of the
+ * container type, like the interpreter.
+ */
+Datum stencil_EEOP_SBSREF_SUBSCRIPTS (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	if (!op.d.sbsref_subscript.subscriptfunc(expression, &op, econtext))
+		__attribute__((musttail))
+		return JUMP_DONE(expression, econtext, isNull);
+	goto_next;
+}
+
+Datum stencil_EEOP_SBSREF_OLD (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	op.d.sbsref.subscriptfunc(expression, &op, econtext);
+	goto_next;
+}
+
+Datum stencil_EEOP_SBSREF_ASSIGN (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	op.d.sbsref.subscriptfunc(expression, &op, econtext);
+	goto_next;
+}
+
+Datum stencil_EEOP_SBSREF_FETCH (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	op.d.sbsref.subscriptfunc(expression, &op, econtext);
+	goto_next;
+}
+
+/*
+ * SBSREF_SUBSCRIPTS followed by SBSREF_FETCH of a single array element. The
+ * element is read directly from 1-D arrays without nulls, stored inline and
+ * uncompressed, of the usual by-value types. Any other array goes through the
+ * functions of the array type. The container is already in op.resvalue, not
+ * null, and the subscript is an int4.
+ *
+ * Arrays of less than 127 bytes read from a tuple have a 1-byte header, their
+ * fields and elements are not aligned and are copied with memcpy.
+ */
+Datum extra_EEOP_SBSREF_ARRAY_FETCH (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	SubscriptingRefState *sbsrefstate = op.d.sbsref_subscript.state;
+	ExprEvalStep *fetch = &op + 1;
+	struct varlena *array = (struct varlena *) DatumGetPointer(*op.resvalue);
+	const char *fields;
+	const char *data;
+	int32 ndim;
+	int32 dataoffset;
+	Oid elemtype;
+	int dim;
+	int lbound;
+	int64 index;
+
+	if (sbsrefstate->upperindexnull[0]) {
+		*op.resnull = true;
+		__attribute__((musttail))
+		return JUMP_DONE(expression, econtext, isNull);
+	}
+	if (VARATT_IS_EXTERNAL(array) || VARATT_IS_COMPRESSED(array))
+		goto generic;
+	// The fields of ArrayType following its length word
+	fields = VARDATA_ANY(array);
+	memcpy(&ndim, fields, sizeof(int32));
+	memcpy(&dataoffset, fields + sizeof(int32), sizeof(int32));
+	// A null bitmap makes dataoffset non zero
+	if (ndim != 1 || dataoffset != 0)
+		goto generic;
+	memcpy(&elemtype, fields + 2 * sizeof(int32), sizeof(Oid));
+	memcpy(&dim, fields + 2 * sizeof(int32) + sizeof(Oid), sizeof(int));
+	memcpy(&lbound, fields + 2 * sizeof(int32) + sizeof(Oid) + sizeof(int), sizeof(int));
+
+	// In 64 bits, a subscript near INT_MIN minus the lower bound would wrap around
+	index = (int64) DatumGetInt32(sbsrefstate->upperindex[0]) - lbound;
+	if (index < 0 || index >= dim) {
+		*op.resnull = true;
+		goto_next;
+	}
+	// The offsets of the data count the 4-byte header a short varlena lost
+	data = fields - VARHDRSZ + ARR_OVERHEAD_NONULLS(1);
+	switch (elemtype) {
+		case BOOLOID:
+		case CHAROID:
+			*op.resvalue = CharGetDatum(data[index]);
+			break;
+		case INT2OID:
+		{
+			int16 value;
+
+			memcpy(&value, data + index * sizeof(int16), sizeof(int16));
+			*op.resvalue = Int16GetDatum(value);
+			break;
+		}
+		case INT4OID:
+		case OIDOID:
+		case FLOAT4OID:
+		case DATEOID:
+		{
+			int32 value;
+
+			memcpy(&value, data + index * sizeof(int32), sizeof(int32));
+			*op.resvalue = Int32GetDatum(value);
+			break;
+		}
+#ifdef USE_FLOAT8_BYVAL
+		case INT8OID:
+		case FLOAT8OID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+		{
+			int64 value;
+
+			memcpy(&value, data + index * sizeof(int64), sizeof(int64));
+			*op.resvalue = Int64GetDatum(value);
+			break;
+		}
+#endif
+		default:
+			goto generic;
+	}
+	*op.resnull = false;
+	goto_next;
+
+generic:
+	if (!op.d.sbsref_subscript.subscriptfunc(expression, &op, econtext))
+		__attribute__((musttail))
+		return JUMP_DONE(expression, econtext, isNull);
+	fetch->d.sbsref.subscriptfunc(expression, fetch, econtext);
+	goto_next;
+}
+#endif
+
+Datum stencil_EEOP_FIELDSELECT (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	ExecEvalFieldSelect(expression, &op, econtext);
+	goto_next;
+}
+
+/*
+ * jsonb -> and ->> with a constant key, detoasted once in JSONB_KEY. Only the
+ * string and null values of ->> are converted here, the others are left to
+ * the function itself.
+ */
+#define JSONB_FIELD_LOOKUP(fcinfo, v, vbuf) \
+	do { \
+		Jsonb *jb; \
+		if ((fcinfo)->args[0].isnull) { \
+			*op.resnull = true; \
+			goto_next; \
+		} \
+		jb = DatumGetJsonbP((fcinfo)->args[0].value); \
+		v = JB_ROOT_IS_OBJECT(jb) ? getKeyJsonValueFromContainer(&jb->root, JSONB_KEY.data, JSONB_KEY.len, &(vbuf)) : NULL; \
+		if (v == NULL) { \
+			*op.resnull = true; \
+			goto_next; \
+		} \
+	} while (0)
+
+Datum extra_EEOP_FUNCEXPR_STRICT_jsonb_object_field (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	FunctionCallInfo fcinfo = op.d.func.fcinfo_data;
+	JsonbValue vbuf;
+	JsonbValue *v;
+
+	JSONB_FIELD_LOOKUP(fcinfo, v, vbuf);
+	*op.resvalue = JsonbPGetDatum(JsonbValueToJsonb(v));
+	*op.resnull = false;
+	goto_next;
+}
+
+Datum extra_EEOP_FUNCEXPR_STRICT_jsonb_object_field_text (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	FunctionCallInfo fcinfo = op.d.func.fcinfo_data;
+	JsonbValue vbuf;
+	JsonbValue *v;
+
+	JSONB_FIELD_LOOKUP(fcinfo, v, vbuf);
+	if (v->type == jbvNull) {
+		*op.resnull = true;
+	} else if (v->type == jbvString) {
+		*op.resvalue = PointerGetDatum(cstring_to_text_with_len(v->val.string.val, v->val.string.len));
+		*op.resnull = false;
+	} else {
+		fcinfo->isnull = false;
+		*op.resvalue = FUNC_CALL(fcinfo);
+		*op.resnull = fcinfo->isnull;
+	}
+	goto_next;
+}
+
+#if PG_VERSION_NUM >= 180000
+/*
+ * Hash keys of hash joins, hash aggregates and hashed subplans. The generic
+ * stencils call the hash function, the extra ones compute the hash of by-value
+ * keys inline: uint32 for hashint4 and hashoid, int8 for hashint8. Both must
+ * give the same values as hash_bytes_uint32 in common/hashfn.c.
+ */
+#define HASH_ROT(x, k) pg_rotate_left32(x, k)
+#define HASH_FINAL(a, b, c) \
+	do { \
+		c ^= b; c -= HASH_ROT(b, 14); \
+		a ^= c; a -= HASH_ROT(c, 11); \
+		b ^= a; b -= HASH_ROT(a, 25); \
+		c ^= b; c -= HASH_ROT(b, 16); \
+		a ^= c; a -= HASH_ROT(c, 4); \
+		b ^= a; b -= HASH_ROT(a, 14); \
+		c ^= b; c -= HASH_ROT(b, 24); \
+	} while (0)
+
+static inline __attribute__((always_inline)) uint32
+inline_hash_uint32(uint32 k)
+{
+	uint32 a, b, c;
+
+	a = b = c = 0x9e3779b9 + (uint32) sizeof(uint32) + 3923095;
+	a += k;
+	HASH_FINAL(a, b, c);
+	return c;
+}
+
+static inline __attribute__((always_inline)) uint32
+inline_hash_int8(int64 val)
+{
+	uint32 lohalf = (uint32) val;
+	uint32 hihalf = (uint32) (val >> 32);
+
+	lohalf ^= (val >= 0) ? hihalf : ~hihalf;
+	return inline_hash_uint32(lohalf);
+}
+
+#define HASH_CALL(fcinfo) DatumGetUInt32(FUNC_CALL(fcinfo))
+#define HASH_UINT32(fcinfo) inline_hash_uint32((uint32) DatumGetInt32((fcinfo)->args[0].value))
+#define HASH_INT8(fcinfo) inline_hash_int8(DatumGetInt64((fcinfo)->args[0].value))
+
+#define HASHDATUM_FIRST(hash) \
+	do { \
+		FunctionCallInfo fcinfo = op.d.hashdatum.fcinfo_data; \
+		*op.resvalue = fcinfo->args[0].isnull ? (Datum) 0 : UInt32GetDatum(hash(fcinfo)); \
+		*op.resnull = false; \
+	} while (0)
+
+#define HASHDATUM_FIRST_STRICT(hash) \
+	do { \
+		FunctionCallInfo fcinfo = op.d.hashdatum.fcinfo_data; \
+		if (fcinfo->args[0].isnull) { \
+			*op.resnull = true; \
+			*op.resvalue = (Datum) 0; \
+			__attribute__((musttail)) \
+			return JUMP_DONE(expression, econtext, isNull); \
+		} \
+		*op.resvalue = UInt32GetDatum(hash(fcinfo)); \
+		*op.resnull = false; \
+	} while (0)
+
+#define HASHDATUM_NEXT32(hash) \
+	do { \
+		FunctionCallInfo fcinfo = op.d.hashdatum.fcinfo_data; \
+		uint32 existinghash = pg_rotate_left32(DatumGetUInt32(op.d.hashdatum.iresult->value), 1); \
+		if (!fcinfo->args[0].isnull) \
+			existinghash ^= hash(fcinfo); \
+		*op.resvalue = UInt32GetDatum(existinghash); \
+		*op.resnull = false; \
+	} while (0)
+
+#define HASHDATUM_NEXT32_STRICT(hash) \
+	do { \
+		FunctionCallInfo fcinfo = op.d.hashdatum.fcinfo_data; \
+		uint32 existinghash; \
+		if (fcinfo->args[0].isnull) { \
+			*op.resnull = true; \
+			*op.resvalue = (Datum) 0; \
+			__attribute__((musttail)) \
+			return JUMP_DONE(expression, econtext, isNull); \
+		} \
+		existinghash = pg_rotate_left32(DatumGetUInt32(op.d.hashdatum.iresult->value), 1); \
+		*op.resvalue = UInt32GetDatum(existinghash ^ hash(fcinfo)); \
+		*op.resnull = false; \
+	} while (0)
+
+Datum stencil_EEOP_HASHDATUM_SET_INITVAL (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	*op.resvalue = op.d.hashdatum_initvalue.init_value;
+	*op.resnull = false;
+	goto_next;
+}
+
+Datum stencil_EEOP_HASHDATUM_FIRST (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_FIRST(HASH_CALL);
+	goto_next;
+}
+
+Datum stencil_EEOP_HASHDATUM_FIRST_STRICT (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_FIRST_STRICT(HASH_CALL);
+	goto_next;
+}
+
+Datum stencil_EEOP_HASHDATUM_NEXT32 (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_NEXT32(HASH_CALL);
+	goto_next;
+}
+
+Datum stencil_EEOP_HASHDATUM_NEXT32_STRICT (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_NEXT32_STRICT(HASH_CALL);
+	goto_next;
+}
+
+Datum extra_EEOP_HASHDATUM_FIRST_uint32 (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_FIRST(HASH_UINT32);
+	goto_next;
+}
+
+Datum extra_EEOP_HASHDATUM_FIRST_STRICT_uint32 (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_FIRST_STRICT(HASH_UINT32);
+	goto_next;
+}
+
+Datum extra_EEOP_HASHDATUM_NEXT32_uint32 (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_NEXT32(HASH_UINT32);
+	goto_next;
+}
+
+Datum extra_EEOP_HASHDATUM_NEXT32_STRICT_uint32 (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_NEXT32_STRICT(HASH_UINT32);
+	goto_next;
+}
+
+Datum extra_EEOP_HASHDATUM_FIRST_int8 (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_FIRST(HASH_INT8);
+	goto_next;
+}
+
+Datum extra_EEOP_HASHDATUM_FIRST_STRICT_int8 (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_FIRST_STRICT(HASH_INT8);
+	goto_next;
+}
+
+Datum extra_EEOP_HASHDATUM_NEXT32_int8 (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_NEXT32(HASH_INT8);
+	goto_next;
+}
+
+Datum extra_EEOP_HASHDATUM_NEXT32_STRICT_int8 (struct ExprState *expression, struct ExprContext *econtext, bool *isNull)
+{
+	HASHDATUM_NEXT32_STRICT(HASH_INT8);
+	goto_next;
+}
+#endif